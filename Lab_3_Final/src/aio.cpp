@@ -0,0 +1,373 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+// The kernel headers define their own BLOCK_SIZE, the one from disk.h is the one used here.
+#undef BLOCK_SIZE
+
+#include "aio.h"
+
+AsyncIO::AsyncIO(Disk &disk, unsigned queueDepth)
+    : m_disk(disk), m_queueDepth(queueDepth > 0 ? queueDepth : 1)
+{
+    if (SetupRing())
+    {
+        m_backend = BACKEND::IO_URING;
+        m_slots.resize(m_queueDepth);
+        for (unsigned slot = 0; slot < m_queueDepth; slot++)
+        {
+            m_freeSlots.push_back(m_queueDepth - 1 - slot);
+        }
+        return;
+    }
+
+    m_backend = BACKEND::THREAD_POOL;
+    const unsigned workerCount = std::min(m_queueDepth, std::max(1u, std::thread::hardware_concurrency() * 2));
+    for (unsigned i = 0; i < workerCount; i++)
+    {
+        m_workers.emplace_back(&AsyncIO::WorkerLoop, this);
+    }
+}
+
+AsyncIO::~AsyncIO()
+{
+    if (m_backend == BACKEND::IO_URING)
+    {
+        // Nothing may complete into buffers that are about to go away.
+        while (m_inFlight > 0 && EnterRing(1) == 0)
+        {
+        }
+        TeardownRing();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_workAvailable.notify_all();
+    for (std::thread &worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+int AsyncIO::Submit(const std::vector<block_io> &ios, bool isWrite, Group &group)
+{
+    std::vector<block_io> sorted(ios);
+    std::sort(sorted.begin(), sorted.end(), [](const block_io &a, const block_io &b) { return a.block_no < b.block_no; });
+
+    size_t runStart = 0;
+    while (runStart < sorted.size())
+    {
+        size_t runEnd = runStart + 1;
+        while (runEnd < sorted.size() && runEnd - runStart < AIO_MAX_RUN_BLOCKS &&
+               sorted[runEnd].block_no == sorted[runEnd - 1].block_no + 1)
+        {
+            runEnd++;
+        }
+
+        Request request;
+        request.isWrite = isWrite;
+        request.ios.assign(sorted.begin() + runStart, sorted.begin() + runEnd);
+        request.group = &group;
+
+        int result = m_backend == BACKEND::IO_URING ? SubmitToRing(std::move(request)) : SubmitToPool(std::move(request));
+        if (result != 0)
+        {
+            return result;
+        }
+        runStart = runEnd;
+    }
+
+    // Hand the new requests to the kernel now so they are served while the caller goes on with other work.
+    if (m_backend == BACKEND::IO_URING && m_ring.toSubmit > 0)
+    {
+        return EnterRing(0);
+    }
+    return 0;
+}
+
+int AsyncIO::Wait(Group &group)
+{
+    if (m_backend == BACKEND::IO_URING)
+    {
+        while (group.pending > 0)
+        {
+            if (EnterRing(1) != 0)
+            {
+                return -1;
+            }
+        }
+        return group.result;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_workDone.wait(lock, [&group] { return group.pending == 0; });
+    return group.result;
+}
+
+int AsyncIO::ReadBlocks(const std::vector<block_io> &ios)
+{
+    Group group;
+    int result = Submit(ios, false, group);
+    // Always wait, the buffers belong to the caller.
+    int waitResult = Wait(group);
+    return result != 0 ? result : waitResult;
+}
+
+int AsyncIO::WriteBlocks(const std::vector<block_io> &ios)
+{
+    Group group;
+    int result = Submit(ios, true, group);
+    int waitResult = Wait(group);
+    return result != 0 ? result : waitResult;
+}
+
+AsyncIO::Stats AsyncIO::GetStats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void AsyncIO::Complete(Request &request, int result)
+{
+    const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - request.submitTime);
+    const uint64_t latencyUs = (uint64_t)latency.count();
+
+    m_stats.totalLatencyUs += latencyUs;
+    m_stats.maxLatencyUs = std::max(m_stats.maxLatencyUs, latencyUs);
+    m_stats.blocks += request.ios.size();
+    if (request.isWrite)
+    {
+        m_stats.writes++;
+    }
+    else
+    {
+        m_stats.reads++;
+    }
+
+    if (result != 0)
+    {
+        request.group->result = -1;
+    }
+    request.group->pending--;
+    m_inFlight--;
+}
+
+bool AsyncIO::SetupRing()
+{
+    // io_uring needs a file descriptor to submit reads and writes against.
+    if (m_disk.get_fd() < 0)
+    {
+        return false;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ringFd = (int)syscall(__NR_io_uring_setup, m_queueDepth, &params);
+    if (ringFd < 0)
+    {
+        return false;
+    }
+    m_ring.fd = ringFd;
+
+    m_ring.sqMemorySize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_ring.cqMemorySize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    m_ring.sqeMemorySize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    m_ring.sqMemory = mmap(nullptr, m_ring.sqMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    m_ring.cqMemory = mmap(nullptr, m_ring.cqMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    m_ring.sqeMemory = mmap(nullptr, m_ring.sqeMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (m_ring.sqMemory == MAP_FAILED || m_ring.cqMemory == MAP_FAILED || m_ring.sqeMemory == MAP_FAILED)
+    {
+        TeardownRing();
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *)m_ring.sqMemory;
+    m_ring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    m_ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    m_ring.sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    m_ring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    m_ring.sqes = (struct io_uring_sqe *)m_ring.sqeMemory;
+
+    uint8_t *cq = (uint8_t *)m_ring.cqMemory;
+    m_ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    m_ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    m_ring.cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    m_ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Make sure vectored reads actually work here (old kernels, seccomp filters) before relying on it.
+    uint8_t probeBlock[BLOCK_SIZE];
+    m_slots.resize(1);
+    m_freeSlots.assign(1, 0);
+    m_backend = BACKEND::IO_URING;
+    Group probeGroup;
+    Request probe;
+    probe.isWrite = false;
+    probe.ios.push_back({0, probeBlock});
+    probe.group = &probeGroup;
+    if (SubmitToRing(std::move(probe)) != 0 || Wait(probeGroup) != 0)
+    {
+        m_inFlight = 0;
+        TeardownRing();
+        return false;
+    }
+
+    m_stats = Stats();
+    m_slots.clear();
+    m_freeSlots.clear();
+    return true;
+}
+
+void AsyncIO::TeardownRing()
+{
+    if (m_ring.sqeMemory != nullptr && m_ring.sqeMemory != MAP_FAILED)
+    {
+        munmap(m_ring.sqeMemory, m_ring.sqeMemorySize);
+    }
+    if (m_ring.cqMemory != nullptr && m_ring.cqMemory != MAP_FAILED)
+    {
+        munmap(m_ring.cqMemory, m_ring.cqMemorySize);
+    }
+    if (m_ring.sqMemory != nullptr && m_ring.sqMemory != MAP_FAILED)
+    {
+        munmap(m_ring.sqMemory, m_ring.sqMemorySize);
+    }
+    if (m_ring.fd >= 0)
+    {
+        close(m_ring.fd);
+    }
+    m_ring = Ring();
+}
+
+int AsyncIO::SubmitToRing(Request &&request)
+{
+    // Make room by waiting for completions once the queue depth is reached.
+    while (m_freeSlots.empty())
+    {
+        if (EnterRing(1) != 0)
+        {
+            return -1;
+        }
+    }
+
+    const unsigned slot = m_freeSlots.back();
+    m_freeSlots.pop_back();
+    Request &slotRequest = m_slots[slot];
+    slotRequest = std::move(request);
+    slotRequest.iov.clear();
+    for (const block_io &io : slotRequest.ios)
+    {
+        slotRequest.iov.push_back({io.buf, BLOCK_SIZE});
+    }
+    slotRequest.submitTime = std::chrono::steady_clock::now();
+    slotRequest.group->pending++;
+
+    const unsigned tail = *m_ring.sqTail;
+    const unsigned index = tail & *m_ring.sqMask;
+    struct io_uring_sqe *sqe = &m_ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = slotRequest.isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = m_disk.get_fd();
+    sqe->off = (uint64_t)slotRequest.ios.front().block_no * BLOCK_SIZE;
+    sqe->addr = (uint64_t)(uintptr_t)slotRequest.iov.data();
+    sqe->len = (unsigned)slotRequest.iov.size();
+    sqe->user_data = slot;
+    m_ring.sqArray[index] = index;
+    // The kernel may only see the new tail after the SQE has been filled in.
+    __atomic_store_n(m_ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    m_ring.toSubmit++;
+    m_inFlight++;
+    m_stats.maxInFlight = std::max(m_stats.maxInFlight, m_inFlight);
+    return 0;
+}
+
+int AsyncIO::EnterRing(unsigned minComplete)
+{
+    ReapRing();
+    if (minComplete > 0 && m_inFlight == 0)
+    {
+        return 0;
+    }
+
+    int entered = (int)syscall(__NR_io_uring_enter, m_ring.fd, m_ring.toSubmit, minComplete, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (entered < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    m_ring.toSubmit -= std::min((unsigned)entered, m_ring.toSubmit);
+
+    ReapRing();
+    return 0;
+}
+
+void AsyncIO::ReapRing()
+{
+    unsigned head = *m_ring.cqHead;
+    const unsigned tail = __atomic_load_n(m_ring.cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        const struct io_uring_cqe &cqe = m_ring.cqes[head & *m_ring.cqMask];
+        const unsigned slot = (unsigned)cqe.user_data;
+        Request &request = m_slots[slot];
+        const int expected = (int)request.ios.size() * BLOCK_SIZE;
+
+        int result = 0;
+        if (cqe.res != expected)
+        {
+            // Short or failed transfer, redo it synchronously so the caller gets a definite answer.
+            result = request.isWrite ? m_disk.write_blocks(request.ios) : m_disk.read_blocks(request.ios);
+        }
+
+        Complete(request, result);
+        m_freeSlots.push_back(slot);
+        head++;
+    }
+    __atomic_store_n(m_ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+int AsyncIO::SubmitToPool(Request &&request)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Requests waiting for a worker count towards the queue depth as well.
+    m_workDone.wait(lock, [this] { return m_inFlight < m_queueDepth; });
+
+    request.submitTime = std::chrono::steady_clock::now();
+    request.group->pending++;
+    m_queue.push_back(std::move(request));
+    m_inFlight++;
+    m_stats.maxInFlight = std::max(m_stats.maxInFlight, m_inFlight);
+
+    lock.unlock();
+    m_workAvailable.notify_one();
+    return 0;
+}
+
+void AsyncIO::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_workAvailable.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+        if (m_queue.empty())
+        {
+            return;
+        }
+
+        Request request = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+        int result = request.isWrite ? m_disk.write_blocks(request.ios) : m_disk.read_blocks(request.ios);
+        lock.lock();
+
+        Complete(request, result);
+        m_workDone.notify_all();
+    }
+}
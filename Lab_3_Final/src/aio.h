@@ -0,0 +1,134 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+
+#include "disk.h"
+
+#ifndef __AIO_H__
+#define __AIO_H__
+
+// Maximum number of block requests in flight at the same time by default.
+#define DEFAULT_IO_QUEUE_DEPTH 16
+// Adjacent blocks are merged into one request, but never more than this many so a long run still
+// gets split over several requests that can be served in parallel.
+#define AIO_MAX_RUN_BLOCKS 16
+
+// Defined in <linux/io_uring.h>, which is only included by aio.cpp as it also brings in a BLOCK_SIZE of its own.
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Asynchronous block I/O under a Disk.
+// Uses io_uring when the kernel supports it and the disk is backed by a file descriptor,
+// otherwise a pool of worker threads calling the disk's own read_blocks/write_blocks.
+class AsyncIO {
+
+public:
+    enum class BACKEND { IO_URING = 0, THREAD_POOL };
+
+    // A set of submitted requests that can be waited for together.
+    // Must stay alive until Wait() has returned for it.
+    struct Group
+    {
+        unsigned pending = 0;
+        int result = 0;
+    };
+
+    struct Stats
+    {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t blocks = 0;
+        uint64_t totalLatencyUs = 0;
+        uint64_t maxLatencyUs = 0;
+        unsigned maxInFlight = 0;
+    };
+
+private:
+    // One run of adjacent blocks read or written with a single vectored transfer.
+    struct Request
+    {
+        bool isWrite;
+        std::vector<block_io> ios;
+        std::vector<struct iovec> iov;
+        Group *group;
+        std::chrono::steady_clock::time_point submitTime;
+    };
+
+    // Memory shared with the kernel for io_uring.
+    struct Ring
+    {
+        int fd = -1;
+        void *sqMemory = nullptr;
+        size_t sqMemorySize = 0;
+        void *cqMemory = nullptr;
+        size_t cqMemorySize = 0;
+        void *sqeMemory = nullptr;
+        size_t sqeMemorySize = 0;
+        unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+        unsigned *cqHead, *cqTail, *cqMask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        // Number of queued SQEs that have not been handed to the kernel yet.
+        unsigned toSubmit = 0;
+    };
+
+private:
+    Disk &m_disk;
+    const unsigned m_queueDepth;
+    BACKEND m_backend;
+    unsigned m_inFlight = 0;
+    Stats m_stats;
+
+    // io_uring backend. Requests live in a fixed set of slots, the slot index is the user data of the SQE.
+    Ring m_ring;
+    std::vector<Request> m_slots;
+    std::vector<unsigned> m_freeSlots;
+
+    // Thread pool backend.
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_workDone;
+    std::deque<Request> m_queue;
+    std::vector<std::thread> m_workers;
+    bool m_stopping = false;
+
+private:
+    bool SetupRing();
+    void TeardownRing();
+    // Hands queued SQEs to the kernel and waits until at least minComplete requests have completed.
+    int EnterRing(unsigned minComplete);
+    void ReapRing();
+    int SubmitToRing(Request &&request);
+
+    void WorkerLoop();
+    int SubmitToPool(Request &&request);
+
+    // Records the result of a finished request. Caller holds m_mutex for the thread pool backend.
+    void Complete(Request &request, int result);
+
+public:
+    AsyncIO(Disk &disk, unsigned queueDepth = DEFAULT_IO_QUEUE_DEPTH);
+    ~AsyncIO();
+
+    // Queues reads or writes of the given blocks and returns without waiting for them.
+    // Blocks only if the queue depth has been reached. Buffers must stay valid until Wait(group) returns.
+    int Submit(const std::vector<block_io> &ios, bool isWrite, Group &group);
+    // Waits until every request of the group has finished. Returns non-zero if any of them failed.
+    int Wait(Group &group);
+
+    // Submits a batch and waits for it.
+    int ReadBlocks(const std::vector<block_io> &ios);
+    int WriteBlocks(const std::vector<block_io> &ios);
+
+    BACKEND GetBackend() const { return m_backend; }
+    const char *GetBackendName() const { return m_backend == BACKEND::IO_URING ? "io_uring" : "thread pool"; }
+    unsigned GetQueueDepth() const { return m_queueDepth; }
+    Stats GetStats();
+};
+
+#endif // __AIO_H__
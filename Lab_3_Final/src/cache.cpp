@@ -0,0 +1,292 @@
+#include <cstring>
+
+#include "cache.h"
+
+BlockCache::BlockCache(Disk &disk, unsigned capacity)
+    : m_disk(disk), m_capacity(capacity > 2 ? capacity : 2) // Peek() followed by Write() needs two lines.
+{
+    m_lookup.reserve(m_capacity);
+}
+
+BlockCache::~BlockCache()
+{
+    Sync();
+}
+
+int BlockCache::Read(unsigned block_no, uint8_t *blk)
+{
+    LineIterator line;
+    if (GetLine(block_no, true, line) != 0)
+    {
+        return -1;
+    }
+
+    memcpy(blk, line->data, BLOCK_SIZE);
+    return 0;
+}
+
+int BlockCache::Write(unsigned block_no, const uint8_t *blk)
+{
+    if (block_no >= m_disk.get_no_blocks())
+    {
+        return -1;
+    }
+
+    // The whole block is replaced so there is no need to read it from disk first.
+    LineIterator line;
+    if (GetLine(block_no, false, line) != 0)
+    {
+        return -1;
+    }
+
+    memcpy(line->data, blk, BLOCK_SIZE);
+    line->dirty = true;
+    return 0;
+}
+
+int BlockCache::ReadBlocks(const std::vector<block_io> &ios, AsyncIO::Group *group)
+{
+    std::vector<block_io> misses;
+    misses.reserve(ios.size());
+    for (const block_io &io : ios)
+    {
+        auto found = m_lookup.find(io.block_no);
+        if (found == m_lookup.end())
+        {
+            m_stats.misses++;
+            misses.push_back(io);
+            continue;
+        }
+
+        m_stats.hits++;
+        memcpy(io.buf, found->second->data, BLOCK_SIZE);
+    }
+
+    if (misses.empty())
+    {
+        return 0;
+    }
+    if (m_aio == nullptr)
+    {
+        return m_disk.read_blocks(misses);
+    }
+    return group != nullptr ? m_aio->Submit(misses, false, *group) : m_aio->ReadBlocks(misses);
+}
+
+int BlockCache::WriteBlocks(const std::vector<block_io> &ios, AsyncIO::Group *group)
+{
+    for (const block_io &io : ios)
+    {
+        auto found = m_lookup.find(io.block_no);
+        if (found != m_lookup.end())
+        {
+            // Written through below, so the cached copy is clean afterwards.
+            memcpy(found->second->data, io.buf, BLOCK_SIZE);
+            found->second->dirty = false;
+        }
+    }
+
+    if (m_aio == nullptr)
+    {
+        return m_disk.write_blocks(ios);
+    }
+    return group != nullptr ? m_aio->Submit(ios, true, *group) : m_aio->WriteBlocks(ios);
+}
+
+int BlockCache::WaitFor(AsyncIO::Group &group)
+{
+    return m_aio != nullptr ? m_aio->Wait(group) : group.result;
+}
+
+const uint8_t *BlockCache::Peek(unsigned block_no)
+{
+    auto found = m_lookup.find(block_no);
+    if (found == m_lookup.end())
+    {
+        const uint8_t *mappedBlock = m_disk.map_block(block_no);
+        if (mappedBlock != nullptr)
+        {
+            m_stats.mapped++;
+            return mappedBlock;
+        }
+    }
+
+    LineIterator line;
+    if (GetLine(block_no, true, line) != 0)
+    {
+        return nullptr;
+    }
+
+    return line->data;
+}
+
+int BlockCache::Sync()
+{
+    // Write all dirty blocks in one batch so adjacent blocks are merged into one transfer.
+    std::vector<block_io> dirtyBlocks;
+    for (CacheLine &line : m_lines)
+    {
+        if (line.dirty)
+        {
+            dirtyBlocks.push_back({line.blockNo, line.data});
+        }
+    }
+
+    int result = 0;
+    if (!dirtyBlocks.empty())
+    {
+        if (m_disk.write_blocks(dirtyBlocks) == 0)
+        {
+            m_stats.writebacks += dirtyBlocks.size();
+            for (CacheLine &line : m_lines)
+            {
+                line.dirty = false;
+            }
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+
+    if (m_disk.sync() != 0)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+int BlockCache::Discard(unsigned first_block, unsigned count)
+{
+    Drop(first_block, count);
+    return m_disk.discard(first_block, count);
+}
+
+void BlockCache::Drop(unsigned first_block, unsigned count)
+{
+    // Short ranges are looked up block by block instead of scanning every line.
+    if (count < m_lines.size())
+    {
+        for (unsigned block_no = first_block; block_no < first_block + count; block_no++)
+        {
+            auto found = m_lookup.find(block_no);
+            if (found != m_lookup.end())
+            {
+                LineIterator line = found->second;
+                m_lookup.erase(found);
+                line->blockNo = NO_CACHED_BLOCK;
+                line->dirty = false;
+                m_lines.splice(m_lines.end(), m_lines, line);
+            }
+        }
+        return;
+    }
+
+    for (LineIterator line = m_lines.begin(); line != m_lines.end();)
+    {
+        LineIterator next = std::next(line);
+        if (line->blockNo >= first_block && line->blockNo - first_block < count)
+        {
+            // Unused lines are moved to the back so they are reused first.
+            m_lookup.erase(line->blockNo);
+            line->blockNo = NO_CACHED_BLOCK;
+            line->dirty = false;
+            m_lines.splice(m_lines.end(), m_lines, line);
+        }
+        line = next;
+    }
+}
+
+unsigned BlockCache::GetDirtyCount() const
+{
+    unsigned dirtyCount = 0;
+    for (const CacheLine &line : m_lines)
+    {
+        dirtyCount += line.dirty ? 1 : 0;
+    }
+
+    return dirtyCount;
+}
+
+int BlockCache::GetLine(unsigned block_no, bool loadFromDisk, LineIterator &lineOut)
+{
+    auto found = m_lookup.find(block_no);
+    if (found != m_lookup.end())
+    {
+        m_stats.hits++;
+        // Move line to the front as it is now the most recently used.
+        m_lines.splice(m_lines.begin(), m_lines, found->second);
+        lineOut = found->second;
+        return 0;
+    }
+
+    m_stats.misses++;
+
+    LineIterator line;
+    if (AcquireLine(line) != 0)
+    {
+        return -1;
+    }
+
+    if (loadFromDisk && m_disk.read(block_no, line->data) != 0)
+    {
+        // Give the line back so it does not hold an invalid block.
+        m_lines.splice(m_lines.end(), m_lines, line);
+        line->blockNo = NO_CACHED_BLOCK;
+        return -1;
+    }
+
+    line->blockNo = block_no;
+    line->dirty = false;
+    m_lookup[block_no] = line;
+
+    lineOut = line;
+    return 0;
+}
+
+int BlockCache::AcquireLine(LineIterator &lineOut)
+{
+    if (m_lines.size() < m_capacity)
+    {
+        m_lines.emplace_front();
+        // Mark as unused until a block is assigned to it.
+        m_lines.front().blockNo = NO_CACHED_BLOCK;
+        m_lines.front().dirty = false;
+        lineOut = m_lines.begin();
+        return 0;
+    }
+
+    // Reuse the least recently used line.
+    LineIterator victim = std::prev(m_lines.end());
+    if (WriteBack(*victim) != 0)
+    {
+        return -1;
+    }
+
+    if (m_lookup.erase(victim->blockNo) > 0)
+    {
+        m_stats.evictions++;
+    }
+    m_lines.splice(m_lines.begin(), m_lines, victim);
+
+    lineOut = m_lines.begin();
+    return 0;
+}
+
+int BlockCache::WriteBack(CacheLine &line)
+{
+    if (!line.dirty)
+    {
+        return 0;
+    }
+
+    if (m_disk.write(line.blockNo, line.data) != 0)
+    {
+        return -1;
+    }
+
+    line.dirty = false;
+    m_stats.writebacks++;
+    return 0;
+}
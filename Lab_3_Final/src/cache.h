@@ -0,0 +1,108 @@
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+#include "disk.h"
+#include "aio.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// Number of blocks kept in memory by default (512 KB).
+#define DEFAULT_CACHE_BLOCKS 128
+// Block number of a line that does not hold any block. Never a valid block, whatever size the disk has.
+#define NO_CACHED_BLOCK 0xFFFFFFFFu
+
+// Write-back LRU cache of disk blocks.
+// Reads are served from memory when possible and writes only mark the cached block as dirty.
+// Dirty blocks are written to disk when they are evicted or when Sync() is called.
+class BlockCache {
+
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t writebacks = 0;
+        // Misses answered directly from a mapped disk without loading the block into the cache.
+        uint64_t mapped = 0;
+    };
+
+private:
+    struct CacheLine
+    {
+        // First and 16 byte aligned, so the block returned by Peek() can be read as dir entries or FAT entries in place.
+        alignas(16) uint8_t data[BLOCK_SIZE];
+        unsigned blockNo;
+        bool dirty;
+    };
+
+    typedef std::list<CacheLine>::iterator LineIterator;
+
+private:
+    Disk &m_disk;
+    const unsigned m_capacity;
+    // Batched reads and writes go through this engine if it is set.
+    AsyncIO *m_aio = nullptr;
+
+    // Front of the list is the most recently used line.
+    std::list<CacheLine> m_lines;
+    std::unordered_map<unsigned, LineIterator> m_lookup;
+
+    Stats m_stats;
+
+private:
+    // Returns the line holding the given block, loading it from disk if needed.
+    // If loadFromDisk is false a missing block gets a line with undefined content (used for full block writes).
+    int GetLine(unsigned block_no, bool loadFromDisk, LineIterator &lineOut);
+
+    // Picks a line to (re)use for a new block. Reuses the least recently used line once the cache is full.
+    int AcquireLine(LineIterator &lineOut);
+
+    // Writes a line to disk if it is dirty.
+    int WriteBack(CacheLine &line);
+
+public:
+    BlockCache(Disk &disk, unsigned capacity = DEFAULT_CACHE_BLOCKS);
+    ~BlockCache();
+
+    // Copies one block into blk, reading it from disk on a miss.
+    int Read(unsigned block_no, uint8_t *blk);
+    // Replaces one block in the cache and marks it dirty. Nothing is written to disk until eviction or Sync().
+    int Write(unsigned block_no, const uint8_t *blk);
+
+    // Reads a batch of blocks into the given buffers. Cached blocks are copied from memory and the rest is
+    // read from disk in one batch straight into the buffers, without being added to the cache.
+    // With an async engine and a group the reads are only submitted, use WaitFor(group) before using the buffers.
+    int ReadBlocks(const std::vector<block_io> &ios, AsyncIO::Group *group = nullptr);
+    // Writes a batch of blocks to disk in one batch. Cached copies are updated so they stay coherent.
+    // With an async engine and a group the writes are only submitted, use WaitFor(group) before reusing the buffers.
+    int WriteBlocks(const std::vector<block_io> &ios, AsyncIO::Group *group = nullptr);
+    // Waits for reads or writes submitted with a group.
+    int WaitFor(AsyncIO::Group &group);
+
+    // Lets batched reads and writes keep several requests in flight. nullptr makes them synchronous again.
+    void SetAsyncIO(AsyncIO *aio) { m_aio = aio; }
+
+    // Returns a read-only pointer to the block without copying it, or nullptr on error.
+    // Served from the cache on a hit, straight from the disk mapping on a miss if the disk is mapped,
+    // otherwise the block is loaded into the cache. The pointer is only valid until the next cache call.
+    // The block is aligned for reading dir entries and FAT entries through the pointer.
+    const uint8_t *Peek(unsigned block_no);
+
+    // Writes all dirty blocks back to disk and makes them durable.
+    int Sync();
+
+    // Zeroes a range of blocks on disk. Cached copies are dropped without being written back.
+    int Discard(unsigned first_block, unsigned count);
+    // Drops cached copies of a range of blocks without writing them back. The disk is left as it is.
+    void Drop(unsigned first_block, unsigned count);
+
+    const Stats &GetStats() const { return m_stats; }
+    unsigned GetCapacity() const { return m_capacity; }
+    unsigned GetSize() const { return (unsigned)m_lines.size(); }
+    unsigned GetDirtyCount() const;
+};
+
+#endif // __CACHE_H__
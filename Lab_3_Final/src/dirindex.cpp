@@ -0,0 +1,61 @@
+#include "dirindex.h"
+
+bool DirIndex::AddEntry(const std::string &name, const DirSlot &slot)
+{
+    return m_names.emplace(name, slot).second;
+}
+
+bool DirIndex::RenameEntry(const std::string &oldName, const std::string &newName)
+{
+    auto found = m_names.find(oldName);
+    if (found == m_names.end() || m_names.count(newName) > 0)
+    {
+        return false;
+    }
+
+    const DirSlot slot = found->second;
+    m_names.erase(found);
+    m_names.emplace(newName, slot);
+    return true;
+}
+
+void DirIndex::RemoveEntry(const std::string &name)
+{
+    auto found = m_names.find(name);
+    if (found == m_names.end())
+    {
+        return;
+    }
+
+    m_freeSlots.push_back(found->second);
+    m_names.erase(found);
+}
+
+bool DirIndex::Find(const std::string &name, DirSlot &slotOut) const
+{
+    auto found = m_names.find(name);
+    if (found == m_names.end())
+    {
+        return false;
+    }
+
+    slotOut = found->second;
+    return true;
+}
+
+void DirIndex::AddFreeSlot(const DirSlot &slot)
+{
+    m_freeSlots.push_back(slot);
+}
+
+bool DirIndex::TakeFreeSlot(DirSlot &slotOut)
+{
+    if (m_freeSlots.empty())
+    {
+        return false;
+    }
+
+    slotOut = m_freeSlots.back();
+    m_freeSlots.pop_back();
+    return true;
+}
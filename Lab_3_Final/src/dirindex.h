@@ -0,0 +1,45 @@
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+// Number of directories whose name index is kept at the same time.
+#define MAX_INDEXED_DIRS 256
+
+// Position of a dir entry: a block of the directory's chain and the slot within that block.
+struct DirSlot
+{
+    uint32_t block;
+    uint32_t slot;
+};
+
+// In-memory index of one directory. Maps every name to its slot and keeps the empty slots,
+// so looking up, adding and removing an entry does not scan the directory.
+class DirIndex {
+
+private:
+    std::unordered_map<std::string, DirSlot> m_names;
+    // Empty slots, the last one is used first.
+    std::vector<DirSlot> m_freeSlots;
+
+public:
+    // Records an existing entry. Returns false if the name is already taken.
+    bool AddEntry(const std::string &name, const DirSlot &slot);
+    // Gives an entry a new name in the same slot. Returns false if the new name is already taken.
+    bool RenameEntry(const std::string &oldName, const std::string &newName);
+    // Forgets an entry and makes its slot available again.
+    void RemoveEntry(const std::string &name);
+    // Returns false if there is no entry with that name.
+    bool Find(const std::string &name, DirSlot &slotOut) const;
+
+    void AddFreeSlot(const DirSlot &slot);
+    // Hands out an empty slot. Returns false if the directory is full.
+    bool TakeFreeSlot(DirSlot &slotOut);
+
+    size_t GetEntryCount() const { return m_names.size(); }
+};
+
+#endif // __DIRINDEX_H__
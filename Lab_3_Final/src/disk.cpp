@@ -1,27 +1,51 @@
 #include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "disk.h"
 
-Disk::Disk()
+Disk::Disk(unsigned no_blocks) : no_blocks(no_blocks), disk_size((uint64_t)BLOCK_SIZE * no_blocks)
 {
-    // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
-        std::cout << "No disk file found...\n";
-        std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
-    }
-    // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
-        std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
-        exit(-1);
+}
+
+void
+Disk::set_no_blocks(unsigned new_no_blocks)
+{
+    no_blocks = new_no_blocks;
+    disk_size = (uint64_t)BLOCK_SIZE * new_no_blocks;
+}
+
+void
+Disk::fit_to_disk_file(int fd)
+{
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size >= BLOCK_SIZE)
+        set_no_blocks((unsigned)(file_stat.st_size / BLOCK_SIZE));
+}
+
+bool
+Disk::valid_block(unsigned block_no, const char *caller)
+{
+    if (DEBUG)
+        std::cout << caller << "(" << block_no << ")\n";
+    // check if valid block number
+    if (block_no >= no_blocks) {
+        std::cout << caller << " - ERROR: Invalid block number (" << block_no << ")\n";
+        return false;
     }
+    return true;
 }
 
-Disk::~Disk()
+void
+Disk::create_disk_file(const std::string& name)
 {
-    diskfile.close();
+    // first check if the disk file exists, otherwise create it.
+    if (!disk_file_exists(name)) {
+        std::cout << "No disk file found...\n";
+        std::cout << "Creating disk file: " << name << std::endl;
+        std::ofstream f(name, std::ios::binary | std::ios::out);
+        f.seekp(disk_size - 1);
+        f.write("", 1);
+    }
 }
 
 bool
@@ -30,37 +54,55 @@ Disk::disk_file_exists (const std::string& name) {
     return f.good();
 }
 
-// writes one block to the disk
+// writes a batch of blocks
 int
-Disk::write(unsigned block_no, uint8_t *blk)
+Disk::write_blocks(const std::vector<block_io>& ios)
 {
-    if (DEBUG)
-        std::cout << "Disk::write(" << block_no << ")\n";
-    // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
-        return -1;
+    for (const block_io& io : ios) {
+        if (write(io.block_no, io.buf) != 0)
+            return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
     return 0;
 }
 
-// reads one block from the disk
+// reads a batch of blocks
 int
-Disk::read(unsigned block_no, uint8_t *blk)
+Disk::read_blocks(const std::vector<block_io>& ios)
 {
-    if (DEBUG)
-        std::cout << "Disk::read(" << block_no << ")\n";
-    // check if valid block number
-    if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
-        return -1;
+    for (const block_io& io : ios) {
+        if (read(io.block_no, io.buf) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// sets count blocks starting at first_block to zero
+int
+Disk::discard(unsigned first_block, unsigned count)
+{
+    uint8_t empty_block[BLOCK_SIZE] = {0};
+    for (unsigned block_no = first_block; block_no < first_block + count; ++block_no) {
+        if (write(block_no, empty_block) != 0)
+            return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
     return 0;
 }
+
+// changes the number of blocks on the disk
+int
+Disk::resize(unsigned new_no_blocks)
+{
+    if (new_no_blocks == no_blocks)
+        return 0;
+    std::cout << "Disk::resize - ERROR: The disk can not be resized\n";
+    return -1;
+}
+
+// deallocates a range of blocks in a disk file so they read back as zeroes
+int
+Disk::punch_hole(int fd, unsigned first_block, unsigned count)
+{
+    off_t offset = (off_t)first_block * BLOCK_SIZE;
+    off_t length = (off_t)count * BLOCK_SIZE;
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0 ? 0 : -1;
+}
@@ -1,28 +1,69 @@
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <vector>
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
 #define BLOCK_SIZE 4096
+#define DEFAULT_NO_BLOCKS 2048
 #define DEBUG false
 
+// One block transfer of a batched read or write.
+struct block_io {
+    unsigned block_no;
+    uint8_t *buf; // BLOCK_SIZE bytes
+};
+
+// Interface for a block device. read/write and the batched calls may be used from several
+// threads at once as long as they touch different blocks. Implementations:
+//   FileDisk   (filedisk.h) - disk file accessed with pread/pwrite
+//   MappedDisk (mmapdisk.h) - disk file mapped into memory
+//   RamDisk    (ramdisk.h)  - disk kept entirely in memory
 class Disk {
-private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+protected:
+    unsigned no_blocks;
+    uint64_t disk_size;
+    // updates no_blocks and disk_size, used when the disk changes size
+    void set_no_blocks(unsigned new_no_blocks);
+    // adopts the size of an existing disk file so images of any size can be opened
+    void fit_to_disk_file(int fd);
+    // prints an error and returns false if block_no is outside the disk
+    bool valid_block(unsigned block_no, const char *caller);
+    // creates a sparse disk file of disk_size bytes if it does not exist yet
+    void create_disk_file(const std::string& name);
     bool disk_file_exists (const std::string& name);
+    // deallocates a range of blocks in a disk file so they read back as zeroes
+    int punch_hole(int fd, unsigned first_block, unsigned count);
 public:
-    Disk();
-    ~Disk();
+    Disk(unsigned no_blocks = DEFAULT_NO_BLOCKS);
+    virtual ~Disk() {}
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    uint64_t get_disk_size() { return disk_size; }
     // writes one block to the disk
-    int write(unsigned block_no, uint8_t *blk);
+    virtual int write(unsigned block_no, uint8_t *blk) = 0;
     // reads one block from the disk
-    int read(unsigned block_no, uint8_t *blk);
+    virtual int read(unsigned block_no, uint8_t *blk) = 0;
+    // writes a batch of blocks, in any order. The default issues one write() per block,
+    // implementations may merge transfers of adjacent blocks.
+    virtual int write_blocks(const std::vector<block_io>& ios);
+    // reads a batch of blocks, see write_blocks()
+    virtual int read_blocks(const std::vector<block_io>& ios);
+    // returns a pointer to the block if the disk is held in memory,
+    // or nullptr if the block has to be read with read()
+    virtual uint8_t *map_block(unsigned /* block_no */) { return nullptr; }
+    // sets count blocks starting at first_block to zero. The default writes zero blocks one by one,
+    // implementations may drop the storage instead.
+    virtual int discard(unsigned first_block, unsigned count);
+    // makes all previous writes durable
+    virtual int sync() { return 0; }
+    // changes the number of blocks on the disk. Blocks that remain keep their content, new blocks read as zeroes.
+    // The default only accepts the current size, i.e. the disk cannot be resized.
+    virtual int resize(unsigned new_no_blocks);
+    // returns the file descriptor holding the disk, or -1 if there is none
+    virtual int get_fd() { return -1; }
 };
 
 #endif // __DISK_H__
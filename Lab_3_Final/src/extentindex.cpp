@@ -0,0 +1,111 @@
+#include <algorithm>
+
+#include "extentindex.h"
+
+const ExtentList *ExtentIndex::Find(uint32_t firstBlock) const
+{
+    auto found = m_chains.find(firstBlock);
+    return found != m_chains.end() ? &found->second : nullptr;
+}
+
+void ExtentIndex::Insert(uint32_t firstBlock, ExtentList extents)
+{
+    Erase(firstBlock);
+    if (m_chains.size() >= MAX_INDEXED_CHAINS)
+    {
+        // Any chain will do, it is rebuilt from the FAT the next time it is needed.
+        Erase(m_chains.begin()->first);
+    }
+
+    for (const Extent &extent : extents)
+    {
+        m_owners.insert({extent.physicalBlock, {firstBlock, extent.length}});
+    }
+    m_chains[firstBlock] = std::move(extents);
+}
+
+void ExtentIndex::InvalidateBlock(uint32_t block)
+{
+    // The extents holding the block, if any, are the last ones starting at or before it.
+    auto owner = m_owners.upper_bound(block);
+    if (owner == m_owners.begin())
+    {
+        return;
+    }
+    owner--;
+
+    std::vector<uint32_t> chainsToErase;
+    for (auto sameStart = m_owners.equal_range(owner->first); sameStart.first != sameStart.second; ++sameStart.first)
+    {
+        if (block - sameStart.first->first < sameStart.first->second.length)
+        {
+            chainsToErase.push_back(sameStart.first->second.firstBlock);
+        }
+    }
+    for (const uint32_t firstBlock : chainsToErase)
+    {
+        Erase(firstBlock);
+    }
+}
+
+void ExtentIndex::Clear()
+{
+    m_chains.clear();
+    m_owners.clear();
+}
+
+void ExtentIndex::Erase(uint32_t firstBlock)
+{
+    auto found = m_chains.find(firstBlock);
+    if (found == m_chains.end())
+    {
+        return;
+    }
+
+    for (const Extent &extent : found->second)
+    {
+        for (auto sameStart = m_owners.equal_range(extent.physicalBlock); sameStart.first != sameStart.second; ++sameStart.first)
+        {
+            if (sameStart.first->second.firstBlock == firstBlock)
+            {
+                m_owners.erase(sameStart.first);
+                break;
+            }
+        }
+    }
+    m_chains.erase(found);
+}
+
+void ExtentIndex::AppendBlock(ExtentList &extents, uint32_t physicalBlock)
+{
+    if (!extents.empty() && extents.back().physicalBlock + extents.back().length == physicalBlock)
+    {
+        extents.back().length++;
+        return;
+    }
+
+    extents.push_back({GetBlockCount(extents), physicalBlock, 1});
+}
+
+int ExtentIndex::Lookup(const ExtentList &extents, uint32_t logicalBlock)
+{
+    // First extent starting after the block, the one before it holds the block.
+    auto extent = std::upper_bound(extents.begin(), extents.end(), logicalBlock,
+                                   [](uint32_t block, const Extent &e) { return block < e.logicalBlock; });
+    if (extent == extents.begin())
+    {
+        return -1;
+    }
+    extent--;
+
+    if (logicalBlock - extent->logicalBlock >= extent->length)
+    {
+        return -1;
+    }
+    return (int)(extent->physicalBlock + (logicalBlock - extent->logicalBlock));
+}
+
+uint32_t ExtentIndex::GetBlockCount(const ExtentList &extents)
+{
+    return extents.empty() ? 0 : extents.back().logicalBlock + extents.back().length;
+}
@@ -0,0 +1,67 @@
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#ifndef __EXTENTINDEX_H__
+#define __EXTENTINDEX_H__
+
+// Number of chains whose extents are kept at the same time.
+#define MAX_INDEXED_CHAINS 1024
+
+// A run of blocks that are adjacent both in the chain and on the disk.
+struct Extent
+{
+    uint32_t logicalBlock; // index of the first block within the chain
+    uint32_t physicalBlock; // block number of the first block on the disk
+    uint32_t length;
+};
+
+typedef std::vector<Extent> ExtentList;
+
+// Maps logical block numbers of a chain to blocks on the disk without walking the FAT.
+// Chains are stored as sorted extent lists keyed by their first block, so a lookup is a binary search over
+// the extents. The index does not know about FAT changes by itself, InvalidateBlock() has to be called
+// for every block whose FAT entry changes.
+class ExtentIndex {
+
+private:
+    struct Owner
+    {
+        uint32_t firstBlock; // chain the extent belongs to
+        uint32_t length;
+    };
+
+private:
+    std::unordered_map<uint32_t, ExtentList> m_chains;
+    // Start of every indexed extent on the disk, used to find the chain holding a given block.
+    // Chains that share their end can have extents starting at the same block.
+    std::multimap<uint32_t, Owner> m_owners;
+
+private:
+    void Erase(uint32_t firstBlock);
+
+public:
+    // Returns the extents of a chain, or nullptr if the chain is not indexed.
+    const ExtentList *Find(uint32_t firstBlock) const;
+
+    // Stores the extents of a chain, replacing any earlier ones. Drops some other chain if the index is full.
+    void Insert(uint32_t firstBlock, ExtentList extents);
+
+    // Drops the chains holding the given block, if any of the indexed chains do. Of chains sharing the block, only the
+    // ones whose extents start at the same block are found, which is enough as long as shared blocks are never relinked.
+    void InvalidateBlock(uint32_t block);
+
+    void Clear();
+
+    // Adds the next block of a chain to the end of an extent list, growing the last extent if the block follows it.
+    static void AppendBlock(ExtentList &extents, uint32_t physicalBlock);
+
+    // Returns the disk block of a logical block of the chain, or -1 if the chain is shorter.
+    static int Lookup(const ExtentList &extents, uint32_t logicalBlock);
+
+    // Returns the number of blocks in the chain.
+    static uint32_t GetBlockCount(const ExtentList &extents);
+};
+
+#endif // __EXTENTINDEX_H__
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "filedisk.h"
+
+FileDisk::FileDisk(const std::string& name)
+{
+    create_disk_file(name);
+    // the disk is simulated as a binary file
+    disk_fd = open(name.c_str(), O_RDWR);
+    if (disk_fd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    fit_to_disk_file(disk_fd);
+}
+
+FileDisk::~FileDisk()
+{
+    close(disk_fd);
+}
+
+// writes one block to the disk
+int
+FileDisk::write(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "FileDisk::write"))
+        return -1;
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    return pwrite(disk_fd, blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+}
+
+// reads one block from the disk
+int
+FileDisk::read(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "FileDisk::read"))
+        return -1;
+    off_t offset = (off_t)block_no * BLOCK_SIZE;
+    return pread(disk_fd, blk, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+}
+
+// writes a batch of blocks with one pwritev per run of adjacent blocks
+int
+FileDisk::write_blocks(const std::vector<block_io>& ios)
+{
+    return transfer_blocks(ios, true);
+}
+
+// reads a batch of blocks with one preadv per run of adjacent blocks
+int
+FileDisk::read_blocks(const std::vector<block_io>& ios)
+{
+    return transfer_blocks(ios, false);
+}
+
+int
+FileDisk::transfer_blocks(const std::vector<block_io>& ios, bool is_write)
+{
+    const char *caller = is_write ? "FileDisk::write_blocks" : "FileDisk::read_blocks";
+    for (const block_io& io : ios) {
+        if (!valid_block(io.block_no, caller))
+            return -1;
+    }
+
+    std::vector<block_io> sorted(ios);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const block_io& a, const block_io& b) { return a.block_no < b.block_no; });
+
+    std::vector<struct iovec> iov;
+    iov.reserve(std::min<size_t>(sorted.size(), IOV_MAX));
+    size_t run_start = 0;
+    while (run_start < sorted.size()) {
+        // extend the run as long as the next block directly follows the previous one
+        size_t run_end = run_start + 1;
+        while (run_end < sorted.size() && run_end - run_start < IOV_MAX &&
+               sorted[run_end].block_no == sorted[run_end - 1].block_no + 1)
+            ++run_end;
+
+        iov.clear();
+        for (size_t i = run_start; i < run_end; ++i)
+            iov.push_back({sorted[i].buf, BLOCK_SIZE});
+
+        off_t offset = (off_t)sorted[run_start].block_no * BLOCK_SIZE;
+        ssize_t expected = (ssize_t)(run_end - run_start) * BLOCK_SIZE;
+        ssize_t transferred = is_write ? pwritev(disk_fd, iov.data(), (int)iov.size(), offset)
+                                       : preadv(disk_fd, iov.data(), (int)iov.size(), offset);
+        if (transferred != expected) {
+            // short transfer, finish the run one block at a time
+            for (size_t i = run_start; i < run_end; ++i) {
+                int result = is_write ? write(sorted[i].block_no, sorted[i].buf)
+                                      : read(sorted[i].block_no, sorted[i].buf);
+                if (result != 0)
+                    return -1;
+            }
+        }
+        run_start = run_end;
+    }
+    return 0;
+}
+
+// zeroes a range of blocks by punching a hole in the disk file
+int
+FileDisk::discard(unsigned first_block, unsigned count)
+{
+    if (count == 0)
+        return 0;
+    if (!valid_block(first_block + count - 1, "FileDisk::discard"))
+        return -1;
+    if (punch_hole(disk_fd, first_block, count) == 0)
+        return 0;
+    // the whole disk can still be dropped in O(1) by truncating the file
+    if (first_block == 0 && count == no_blocks &&
+        ftruncate(disk_fd, 0) == 0 && ftruncate(disk_fd, disk_size) == 0)
+        return 0;
+    return Disk::discard(first_block, count);
+}
+
+// grows or shrinks the disk file, blocks added at the end are sparse
+int
+FileDisk::resize(unsigned new_no_blocks)
+{
+    if (ftruncate(disk_fd, (off_t)new_no_blocks * BLOCK_SIZE) != 0)
+        return -1;
+    set_no_blocks(new_no_blocks);
+    return 0;
+}
+
+// makes all previous writes durable on the disk file
+int
+FileDisk::sync()
+{
+    return fdatasync(disk_fd) == 0 ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#include "disk.h"
+
+#ifndef __FILEDISK_H__
+#define __FILEDISK_H__
+
+// The disk is simulated as a binary file accessed with positional reads and writes.
+class FileDisk : public Disk {
+private:
+    int disk_fd = -1;
+    // sorts the batch and moves every run of adjacent blocks with a single preadv/pwritev
+    int transfer_blocks(const std::vector<block_io>& ios, bool is_write);
+public:
+    FileDisk(const std::string& name = DISKNAME);
+    ~FileDisk();
+    int write(unsigned block_no, uint8_t *blk) override;
+    int read(unsigned block_no, uint8_t *blk) override;
+    int write_blocks(const std::vector<block_io>& ios) override;
+    int read_blocks(const std::vector<block_io>& ios) override;
+    int discard(unsigned first_block, unsigned count) override;
+    int resize(unsigned new_no_blocks) override;
+    int sync() override;
+    int get_fd() override { return disk_fd; }
+};
+
+#endif // __FILEDISK_H__
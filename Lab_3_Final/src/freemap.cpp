@@ -0,0 +1,150 @@
+#include "freemap.h"
+
+#define BITS_PER_WORD 64
+
+void FreeMap::Reset(unsigned blockCount)
+{
+    m_blockCount = blockCount;
+    m_freeCount = 0;
+    m_words.assign((blockCount + BITS_PER_WORD - 1) / BITS_PER_WORD, 0);
+}
+
+void FreeMap::SetFree(unsigned block, bool isFree)
+{
+    if (block >= m_blockCount || IsFree(block) == isFree)
+    {
+        return;
+    }
+
+    const uint64_t mask = (uint64_t)1 << (block % BITS_PER_WORD);
+    if (isFree)
+    {
+        m_words[block / BITS_PER_WORD] |= mask;
+        m_freeCount++;
+    }
+    else
+    {
+        m_words[block / BITS_PER_WORD] &= ~mask;
+        m_freeCount--;
+    }
+}
+
+bool FreeMap::IsFree(unsigned block) const
+{
+    if (block >= m_blockCount)
+    {
+        return false;
+    }
+
+    return (m_words[block / BITS_PER_WORD] >> (block % BITS_PER_WORD)) & 1;
+}
+
+int FreeMap::FindNextFree(unsigned startBlock) const
+{
+    if (m_freeCount == 0)
+    {
+        return -1;
+    }
+    if (startBlock >= m_blockCount)
+    {
+        startBlock = 0;
+    }
+
+    const unsigned wordCount = (unsigned)m_words.size();
+    const unsigned startWord = startBlock / BITS_PER_WORD;
+
+    // Look at one word (64 blocks) at a time. Bits below startBlock are masked away in the first word
+    // and checked last, after wrapping around.
+    for (unsigned i = 0; i <= wordCount; i++)
+    {
+        const unsigned wordIndex = (startWord + i) % wordCount;
+        uint64_t word = m_words[wordIndex];
+        if (i == 0)
+        {
+            word &= ~(uint64_t)0 << (startBlock % BITS_PER_WORD);
+        }
+        else if (i == wordCount)
+        {
+            word &= ((uint64_t)1 << (startBlock % BITS_PER_WORD)) - 1;
+        }
+
+        if (word != 0)
+        {
+            return (int)(wordIndex * BITS_PER_WORD + __builtin_ctzll(word));
+        }
+    }
+
+    return -1;
+}
+
+unsigned FreeMap::GetRunLength(unsigned startBlock, unsigned maxLength) const
+{
+    if (!IsFree(startBlock))
+    {
+        return 0;
+    }
+
+    const unsigned runLength = FindNextUsed(startBlock) - startBlock;
+    return runLength < maxLength ? runLength : maxLength;
+}
+
+int FreeMap::FindBestFitRun(unsigned minLength) const
+{
+    if (minLength == 0 || minLength > m_freeCount)
+    {
+        return -1;
+    }
+
+    int bestStart = -1;
+    unsigned bestLength = 0;
+    unsigned searchBlock = 0;
+    // Visit every free run once, from the start of the disk to the end.
+    while (searchBlock < m_blockCount)
+    {
+        const int runStart = FindNextFree(searchBlock);
+        // FindNextFree wraps around, which means every run has been visited.
+        if (runStart == -1 || (unsigned)runStart < searchBlock)
+        {
+            break;
+        }
+
+        const unsigned runEnd = FindNextUsed(runStart);
+        const unsigned runLength = runEnd - runStart;
+        if (runLength >= minLength && (bestStart == -1 || runLength < bestLength))
+        {
+            bestStart = runStart;
+            bestLength = runLength;
+            // Cannot do better than an exact fit.
+            if (runLength == minLength)
+            {
+                break;
+            }
+        }
+
+        searchBlock = runEnd;
+    }
+
+    return bestStart;
+}
+
+unsigned FreeMap::FindNextUsed(unsigned startBlock) const
+{
+    const unsigned wordCount = (unsigned)m_words.size();
+    for (unsigned wordIndex = startBlock / BITS_PER_WORD; wordIndex < wordCount; wordIndex++)
+    {
+        // Used blocks are the zero bits, so look for set bits in the inverted word.
+        uint64_t word = ~m_words[wordIndex];
+        if (wordIndex == startBlock / BITS_PER_WORD)
+        {
+            word &= ~(uint64_t)0 << (startBlock % BITS_PER_WORD);
+        }
+
+        if (word != 0)
+        {
+            const unsigned usedBlock = wordIndex * BITS_PER_WORD + __builtin_ctzll(word);
+            return usedBlock < m_blockCount ? usedBlock : m_blockCount;
+        }
+    }
+
+    return m_blockCount;
+}
@@ -0,0 +1,45 @@
+#include <cstdint>
+#include <vector>
+
+#ifndef __FREEMAP_H__
+#define __FREEMAP_H__
+
+// Bitmap over all blocks of the disk with one bit per block, set if the block is free.
+// Keeps a running count of free blocks so space checks do not have to scan the FAT.
+class FreeMap {
+
+private:
+    std::vector<uint64_t> m_words;
+    unsigned m_blockCount = 0;
+    unsigned m_freeCount = 0;
+
+private:
+    // Returns the first used block at or after startBlock, or the block count if there is none.
+    unsigned FindNextUsed(unsigned startBlock) const;
+
+public:
+    // Resizes the map to the given block count and marks every block as used.
+    void Reset(unsigned blockCount);
+
+    // Marks a block as free or used.
+    void SetFree(unsigned block, bool isFree);
+
+    bool IsFree(unsigned block) const;
+
+    // Returns the first free block at or after startBlock, wrapping around at the end of the disk.
+    // Returns -1 if there are no free blocks.
+    int FindNextFree(unsigned startBlock) const;
+
+    // Returns the number of free blocks in a row starting at startBlock (0 if startBlock is used).
+    // Stops counting once maxLength is reached.
+    unsigned GetRunLength(unsigned startBlock, unsigned maxLength) const;
+
+    // Returns the start of the smallest run of free blocks that is at least minLength long.
+    // Returns -1 if no run is long enough.
+    int FindBestFitRun(unsigned minLength) const;
+
+    unsigned GetFreeCount() const { return m_freeCount; }
+    unsigned GetBlockCount() const { return m_blockCount; }
+};
+
+#endif // __FREEMAP_H__
@@ -1,51 +1,93 @@
 #include <iostream>
+#include <algorithm>
 #include <cstring>
 #include <vector>
 #include <sstream>
+#include <chrono>
+#include <thread>
 
 #include "fs.h"
 
-FS::FS()
+FS::FS(Disk &disk, unsigned ioQueueDepth)
+    : m_disk(disk),
+      m_aio(ioQueueDepth > 0 ? std::make_unique<AsyncIO>(disk, ioQueueDepth) : nullptr),
+      m_cache(m_disk)
 {
     std::cout << "FS::FS()... Creating file system\n";
+    m_cache.SetAsyncIO(m_aio.get());
+
+    Mount();
 }
 
-FS::~FS() {}
+FS::~FS()
+{
+    // Make sure nothing is lost from the cache at shutdown, and that no freed block keeps its old data.
+    ZeroFreedBlocks();
+    m_cache.Sync();
+}
 
 // formats the disk, i.e., creates an empty file system
-int FS::format()
+int FS::format(unsigned blockCount)
 {
     std::cout << "FS::format()\n";
+    FATBatch fatBatch(*this);
 
-    char emptyBlock[BLOCK_SIZE] = {'\0'};
-    for (int i = 0; i < m_disk.get_no_blocks(); i++)
+    if (blockCount == 0)
     {
-        if (m_disk.write(i, (uint8_t *)emptyBlock) != 0)
-        {
-            return ERROR_CODE;
-        }
+        blockCount = m_disk.get_no_blocks();
+    }
+    if (blockCount < MIN_FS_BLOCKS || blockCount > MAX_FS_BLOCKS)
+    {
+        return ERROR_CODE;
     }
 
-    // Set busy for root block and FAT block.
-    if (MakeFATEntry(ROOT_BLOCK, FAT_EOF) != 0)
+    // Zero the whole disk at once. The disk drops its storage instead of writing every block,
+    // which leaves an empty root directory and only the superblock and FAT to be written below.
+    if (m_cache.Discard(0, m_disk.get_no_blocks()) != 0)
+    {
+        return ERROR_CODE;
+    }
+    if (m_disk.resize(blockCount) != 0 || SetupFAT(blockCount) != 0)
     {
+        // The old file system is gone either way.
+        SetupFAT(0);
         return ERROR_CODE;
     }
-    if (MakeFATEntry(FAT_BLOCK, FAT_EOF) != 0)
+
+    super_block superBlock = {FS_MAGIC, FS_VERSION, m_blockCount, FAT_START_BLOCK, m_reservedBlocks - FAT_START_BLOCK};
+    uint8_t superBlockData[BLOCK_SIZE] = {0};
+    memcpy(superBlockData, &superBlock, sizeof(superBlock));
+    if (m_cache.Write(SUPER_BLOCK, superBlockData) != 0)
     {
         return ERROR_CODE;
     }
 
-    // Start initializing after root and FAT block.
-    for (int i = FAT_BLOCK + 1; i < FAT_SIZE; i++)
+    // Set busy for root, superblock and FAT blocks.
+    for (uint32_t block = 0; block < m_reservedBlocks; block++)
     {
-        if (MakeFATEntry(i, FAT_FREE) != 0)
+        if (MakeFATEntry(block, FAT_EOF) != 0)
         {
             return ERROR_CODE;
         }
     }
 
-    return 0;
+    // All other entries are already FAT_FREE, but every FAT block still has to be written once.
+    for (uint32_t block = m_reservedBlocks; block < m_blockCount; block++)
+    {
+        m_freeMap.SetFree(block, true);
+    }
+    for (uint32_t fatBlock = 0; fatBlock < m_reservedBlocks - FAT_START_BLOCK; fatBlock++)
+    {
+        MarkFATBlockDirty(fatBlock);
+    }
+
+    // The old CWD and all open files no longer exist.
+    m_cwdBlock = ROOT_BLOCK;
+    m_cwdPath.clear();
+    m_openFiles.clear();
+    m_allocCursor = 0;
+
+    return fatBatch.Flush();
 }
 
 // create <filepath> creates a new file on the disk, the data content is
@@ -53,15 +95,14 @@ int FS::format()
 int FS::create(std::string filepath)
 {
     std::cout << "FS::create(" << filepath << ")\n";
+    FATBatch fatBatch(*this);
 
-    if (!FilenamesAreValid(filepath) || FilepathExists(filepath))
+    ResolvedPath newFile;
+    if (ResolvePath(filepath, newFile) != 0 || newFile.exists)
     {
         return ERROR_CODE;
     }
-
-    std::vector<std::string> parsedDirPath = ParseDirPath(filepath);
-    std::string newFilename = parsedDirPath.back();
-    parsedDirPath.pop_back();
+    const std::string &newFilename = newFile.name;
 
     // Get user data
     std::string inputBuffer;
@@ -84,7 +125,7 @@ int FS::create(std::string filepath)
     };
 
     dir_entry newDirEntry = {};
-    strcpy(newDirEntry.file_name, filepath.c_str());
+    strcpy(newDirEntry.file_name, newFilename.c_str());
     newDirEntry.size = inputBufferSize;
     newDirEntry.first_blk = allocatedFirstBlock;
     newDirEntry.type = TYPE_FILE;
@@ -96,12 +137,12 @@ int FS::create(std::string filepath)
     }
 
     // Make dir entry.
-    if (AddNewDirEntry(GetDirectoryBlock(parsedDirPath), newDirEntry) != 0)
+    if (AddNewDirEntry(newFile.parentDirBlock, newDirEntry) != 0)
     {
         return ERROR_CODE;
     }
 
-    return 0;
+    return fatBatch.Flush();
 }
 
 // cat <filepath> reads the content of a file and prints it on the screen
@@ -109,34 +150,24 @@ int FS::cat(std::string filepath)
 {
     std::cout << "FS::cat(" << filepath << ")\n";
 
-    if (!FilenamesAreValid(filepath) || !FilepathExists(filepath))
+    ResolvedPath file;
+    if (ResolvePath(filepath, file) != 0 || !file.exists)
     {
         return ERROR_CODE;
     }
 
-    dir_entry fileDirEntry;
-    GetDirEntry(ParseDirPath(filepath), fileDirEntry);
-
+    const dir_entry &fileDirEntry = file.entry;
     if (fileDirEntry.type != TYPE_FILE || !HasValidAccess(fileDirEntry, READ))
     {
         return ERROR_CODE;
     }
 
-    int currentFileBlock = fileDirEntry.first_blk;
-    char fileBlockBuffer[BLOCK_SIZE] = {'\0'};
-    std::string catOutput = "";
-    while (currentFileBlock != FAT_EOF)
+    if (WriteFileToStream(fileDirEntry, std::cout) != 0)
     {
-        if (m_disk.read(currentFileBlock, (uint8_t *)fileBlockBuffer) != 0)
-        {
-            return ERROR_CODE;
-        }
-        catOutput.append(fileBlockBuffer);
-
-        currentFileBlock = GetChildBlock(currentFileBlock);
+        return ERROR_CODE;
     }
 
-    std::cout << catOutput << std::endl;
+    std::cout << std::endl;
     return 0;
 }
 
@@ -171,63 +202,67 @@ int FS::ls()
         maxLengths[i] = (int)columnData[i].back().size();
     }
 
-    // Gets all dir entries in CWD.
-    dir_entry dirEntries[DIR_BLOCK_SIZE];
-    if (m_disk.read(m_cwdBlock, (uint8_t *)dirEntries))
-    {
-        return ERROR_CODE;
-    }
-
     int nDirEntriesAdded = 0;
-    // For each dir entry we want to add information to each column.
-    for (dir_entry &dirEntry : dirEntries)
+    // Gets all dir entries in CWD, block by block.
+    const int result = ForEachDirBlock(m_cwdBlock, [&](const uint32_t, const dir_entry *dirEntries)
     {
-        if (!DirEntryExists(dirEntry))
-        {
-            continue;
-        }
-
-        // For each column we want to add its own specified data from the dir entry.
-        for (int i = 0; i < columnCount; i++)
+        // For each dir entry we want to add information to each column.
+        for (uint32_t entryIndex = 0; entryIndex < DIR_BLOCK_SIZE; entryIndex++)
         {
-            std::string columnEntry;
-
-            switch (i)
+            const dir_entry &dirEntry = dirEntries[entryIndex];
+            if (!DirEntryExists(dirEntry))
             {
-            case HEADERS::NAME:
-                columnEntry = dirEntry.file_name;
-                break;
+                continue;
+            }
 
-            case HEADERS::SIZE:
-                columnEntry = dirEntry.size == 0 ? "-" : std::to_string(dirEntry.size);
+            // For each column we want to add its own specified data from the dir entry.
+            for (int i = 0; i < columnCount; i++)
+            {
+                std::string columnEntry;
+
+                switch (i)
+                {
+                case HEADERS::NAME:
+                    columnEntry = dirEntry.file_name;
+                    break;
+
+                case HEADERS::SIZE:
+                    columnEntry = dirEntry.size == 0 ? "-" : std::to_string(dirEntry.size);
+                    break;
+
+                case HEADERS::TYPE:
+                    columnEntry = dirEntry.type == TYPE_FILE ? "file" : "dir";
+                    break;
+
+                case HEADERS::AXS_RIGHTS:
+                {
+                    const int axsRights = dirEntry.access_rights;
+                    columnEntry = axsRights & READ ? "r" : "-";
+                    columnEntry += axsRights & WRITE ? "w" : "-";
+                    columnEntry += axsRights & EXECUTE ? "x" : "-";
+                }
                 break;
 
-            case HEADERS::TYPE:
-                columnEntry = dirEntry.type == TYPE_FILE ? "file" : "dir";
-                break;
+                default:
+                    // This should never run as every case should be covered.
+                    columnEntry = "N/A";
+                    break;
+                }
 
-            case HEADERS::AXS_RIGHTS:
-            {
-                const int axsRights = dirEntry.access_rights;
-                columnEntry = axsRights & READ ? "r" : "-";
-                columnEntry += axsRights & WRITE ? "w" : "-";
-                columnEntry += axsRights & EXECUTE ? "x" : "-";
-            }
-            break;
+                columnData[i].push_back(columnEntry);
 
-            default:
-                // This should never run as every case should be covered.
-                columnEntry = "N/A";
-                break;
+                // Replaces previous max length if new entry is larger.
+                maxLengths[i] = (int)columnEntry.size() > maxLengths[i] ? (int)columnEntry.size() : maxLengths[i];
             }
 
-            columnData[i].push_back(columnEntry);
-
-            // Replaces previous max length if new entry is larger.
-            maxLengths[i] = columnEntry.size() > maxLengths[i] ? columnEntry.size() : maxLengths[i];
+            nDirEntriesAdded++;
         }
 
-        nDirEntriesAdded++;
+        return 0;
+    });
+    if (result != 0)
+    {
+        return ERROR_CODE;
     }
 
     const std::string defaultColumnMargin = "\t";
@@ -257,57 +292,54 @@ int FS::ls()
 int FS::cp(std::string sourcepath, std::string destpath)
 {
     std::cout << "FS::cp(" << sourcepath << "," << destpath << ")\n";
+    FATBatch fatBatch(*this);
 
-    if (!FilenamesAreValid(sourcepath) || !FilenamesAreValid(destpath))
-    {
-        return ERROR_CODE;
-    }
-    if (!FilepathExists(sourcepath))
+    ResolvedPath source;
+    ResolvedPath dest;
+    if (ResolvePath(sourcepath, source) != 0 || !source.exists || ResolvePath(destpath, dest) != 0)
     {
         return ERROR_CODE;
     }
 
-    dir_entry sourceDirEntry;
-    GetDirEntry(ParseDirPath(sourcepath), sourceDirEntry);
-    if (!DirEntryExists(sourceDirEntry))
-    {
-        return ERROR_CODE;
-    }
+    const dir_entry &sourceDirEntry = source.entry;
     // Return error if the found dir entry is not a file or if the file cannot be read from.
     if (sourceDirEntry.type != TYPE_FILE || !HasValidAccess(sourceDirEntry, READ))
     {
         return ERROR_CODE;
     }
 
-    dir_entry destDirEntry;
-    StringVector parsedDestPath = ParseDirPath(destpath);
-    if (GetDirEntry(parsedDestPath, destDirEntry) != 0)
-    {
-        return ERROR_CODE;
-    }
-
-    // Will either be the current directory or the specified directory given by destpath.
+    // Will either be the directory given by destpath or the directory the new file is named in.
     int dirBlock;
     std::string destFileName;
-    if (destDirEntry.type == TYPE_DIR)
+    if (dest.exists && dest.entry.type == TYPE_DIR)
     {
-        dirBlock = destDirEntry.first_blk;
+        dirBlock = dest.entry.first_blk;
         destFileName = sourceDirEntry.file_name;
     }
     else
     {
         // Return error if a file already exists or if the filename given has any special characters.
-        if (DirEntryExists(destDirEntry) || HasSpecialCharacters(destpath))
+        if (dest.exists || HasSpecialCharacters(dest.name))
         {
             return ERROR_CODE;
         }
-        dirBlock = m_cwdBlock;
-        destFileName = destpath;
+        dirBlock = dest.parentDirBlock;
+        destFileName = dest.name;
     }
 
+    // The copy gets its own first block, so every file is still found by its first block, and links it to the
+    // rest of the source's chain. The shared blocks are copied once either file changes them.
     int firstFreeBlock;
-    if (AllocateNewFileOnFAT(CalculateMinBlockCount(sourceDirEntry.size), &firstFreeBlock) != 0)
+    if (AllocateNewFileOnFAT(1, &firstFreeBlock) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    uint8_t firstBlockData[BLOCK_SIZE];
+    if (m_cache.Read(sourceDirEntry.first_blk, firstBlockData) != 0 || m_cache.Write(firstFreeBlock, firstBlockData) != 0 ||
+        MakeFATEntry(firstFreeBlock, GetChildBlock(sourceDirEntry.first_blk)) != 0)
     {
+        FreeChain(firstFreeBlock);
         return ERROR_CODE;
     }
 
@@ -318,28 +350,10 @@ int FS::cp(std::string sourcepath, std::string destpath)
     // Add the dir entry to the evaluted correct dir block.
     if (AddNewDirEntry(dirBlock, sourceDirCopy) != 0)
     {
+        FreeChain(firstFreeBlock);
         return ERROR_CODE;
     }
-
-    int currentSourceBlock = sourceDirEntry.first_blk;
-    int currentDestBlock = sourceDirCopy.first_blk;
-    while (currentSourceBlock != FAT_EOF)
-    {
-        char dataBuffer[BLOCK_SIZE]; // No need to initialize as whole block will be written.
-        if (m_disk.read(currentSourceBlock, (uint8_t *)dataBuffer) != 0)
-        {
-            return ERROR_CODE;
-        }
-        if (m_disk.write(currentDestBlock, (uint8_t *)dataBuffer) != 0)
-        {
-            return ERROR_CODE;
-        }
-
-        currentSourceBlock = GetChildBlock(currentSourceBlock);
-        currentDestBlock = GetChildBlock(currentDestBlock);
-    }
-
-    return 0;
+    return fatBatch.Flush();
 }
 
 // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
@@ -348,84 +362,71 @@ int FS::mv(std::string sourcepath, std::string destpath)
 {
     std::cout << "FS::mv(" << sourcepath << "," << destpath << ")\n";
 
-    if (!FilenamesAreValid(sourcepath) || !FilenamesAreValid(destpath))
-    {
-        return ERROR_CODE;
-    }
-    if (!FilepathExists(sourcepath))
+    ResolvedPath source;
+    ResolvedPath dest;
+    if (ResolvePath(sourcepath, source) != 0 || !source.exists || ResolvePath(destpath, dest) != 0)
     {
         return ERROR_CODE;
     }
-
-    StringVector sourceParsedPath = ParseDirPath(sourcepath);
-    std::string sourceFileName = sourceParsedPath.back();
-
-    dir_entry sourceDirEntry;
-    // Get dir entry of source file.
-    GetDirEntry(sourceParsedPath, sourceDirEntry);
-    if (sourceDirEntry.type == TYPE_DIR)
+    if (source.entry.type == TYPE_DIR)
     {
         return ERROR_CODE;
     }
-    sourceParsedPath.pop_back();
-    int sourceDirEntryBlock = GetDirectoryBlock(sourceParsedPath);
 
-    dir_entry destDirEntry;
-    // Get dir entry of destpath (if it exists).
-    StringVector destParsedPath = ParseDirPath(destpath);
-    if (GetDirEntry(destParsedPath, destDirEntry) != 0)
+    // Will either be the directory given by destpath or the directory the file is renamed in.
+    int destDirBlock;
+    dir_entry movedDirEntry = source.entry;
+    if (dest.exists && dest.entry.type == TYPE_DIR) // Move to dir
     {
-        return ERROR_CODE;
+        destDirBlock = dest.entry.first_blk;
     }
-
-    if (destDirEntry.type == TYPE_DIR) // Move to dir
+    else // Rename file.
     {
-        // Write dir entry in dest dir.
-        if (AddNewDirEntry(destDirEntry.first_blk, sourceDirEntry) != 0)
+        // Return error if a file already exists or if the filename given has any special characters.
+        if (dest.exists || HasSpecialCharacters(dest.name))
         {
             return ERROR_CODE;
         }
+        destDirBlock = dest.parentDirBlock;
+        strcpy(movedDirEntry.file_name, dest.name.c_str());
+    }
 
-        dir_entry emptyDirEntry = {};
-        // Remove dir entry from source dir.
-        if (UpdateDirEntry(sourceDirEntryBlock, sourceDirEntry, emptyDirEntry) != 0)
-        {
-            return ERROR_CODE;
-        }
+    // A rename within the directory keeps the entry in its slot.
+    if (destDirBlock == (int)source.parentDirBlock)
+    {
+        return UpdateDirEntry(source, movedDirEntry);
     }
-    else // Rename file.
+
+    // Open handles find their file by its slot, so an open file can only be renamed in place.
+    if (FileIsOpen(source.entry.first_blk))
     {
-        // Return error if a file already exists or if the filename given has any special characters.
-        if (DirEntryExists(destDirEntry) || HasSpecialCharacters(destpath))
-        {
-            return ERROR_CODE;
-        }
+        return ERROR_CODE;
+    }
 
-        std::string newFileName = destpath;
-        dir_entry newSourceDirEntry = sourceDirEntry;
-        strcpy(newSourceDirEntry.file_name, newFileName.c_str());
-        if (UpdateDirEntry(sourceDirEntryBlock, sourceDirEntry, newSourceDirEntry) != 0)
-        {
-            return ERROR_CODE;
-        }
+    // Write dir entry in dest dir.
+    if (AddNewDirEntry(destDirBlock, movedDirEntry) != 0)
+    {
+        return ERROR_CODE;
     }
 
-    return 0;
+    dir_entry emptyDirEntry = {};
+    // Remove dir entry from source dir.
+    return UpdateDirEntry(source, emptyDirEntry);
 }
 
 // rm <filepath> removes / deletes the file <filepath>
 int FS::rm(std::string filepath)
 {
     std::cout << "FS::rm(" << filepath << ")\n";
+    FATBatch fatBatch(*this);
 
-    if (!FilenamesAreValid(filepath) || !FilepathExists(filepath))
+    ResolvedPath file;
+    if (ResolvePath(filepath, file) != 0 || !file.exists)
     {
         return ERROR_CODE;
     }
-
-    dir_entry tempDirEntryHolder;
-    StringVector parsedPath = ParseDirPath(filepath);
-    if (GetDirEntry(parsedPath, tempDirEntryHolder) != 0)
+    const dir_entry tempDirEntryHolder = file.entry;
+    if (tempDirEntryHolder.type == TYPE_FILE && FileIsOpen(tempDirEntryHolder.first_blk))
     {
         return ERROR_CODE;
     }
@@ -438,30 +439,33 @@ int FS::rm(std::string filepath)
     }
 
     dir_entry emptyDirEntry = {};
-    parsedPath.pop_back();
-    if (UpdateDirEntry(GetDirectoryBlock(parsedPath), tempDirEntryHolder, emptyDirEntry) != 0)
+    if (UpdateDirEntry(file, emptyDirEntry) != 0)
     {
         return ERROR_CODE;
     }
 
-    int currentBlock = tempDirEntryHolder.first_blk;
-    while (currentBlock != FAT_EOF)
+    if (tempDirEntryHolder.type == TYPE_DIR)
     {
-        // Zero out data at the block.
-        // This was done as to make sure that when any file want to use the free block it should not contain data.
-        // The decision was made to do this at removal instead of creation as there are many sources of creating a file but only one of removing.
-        char emptyBlock[BLOCK_SIZE] = {'\0'};
-        m_disk.write(currentBlock, (uint8_t *)emptyBlock);
+        m_dirIndexes.erase(tempDirEntryHolder.first_blk);
+        m_dentryCache.InvalidateDirectory(tempDirEntryHolder.first_blk);
+        m_dirParents.erase(tempDirEntryHolder.first_blk);
 
-        int nextBlock = GetChildBlock(currentBlock);
-        if (MakeFATEntry(currentBlock, FAT_FREE) != 0)
+        // An empty directory can only be CWD itself, never one of its parents. CWD moves up to the parent.
+        if (tempDirEntryHolder.first_blk == m_cwdBlock)
         {
-            return ERROR_CODE;
+            m_cwdBlock = file.parentDirBlock;
+            if (!m_cwdPath.empty())
+            {
+                m_cwdPath.pop_back();
+            }
         }
-        currentBlock = nextBlock;
     }
-
-    return 0;
+    // Blocks the file shares with copies are left to the copies.
+    if (FreeChain(tempDirEntryHolder.first_blk) != 0)
+    {
+        return ERROR_CODE;
+    }
+    return fatBatch.Flush();
 }
 
 // append <filepath1> <filepath2> appends the contents of file <filepath1> to
@@ -469,22 +473,17 @@ int FS::rm(std::string filepath)
 int FS::append(std::string filepath1, std::string filepath2)
 {
     std::cout << "FS::append(" << filepath1 << "," << filepath2 << ")\n";
+    FATBatch fatBatch(*this);
 
-    if (!FilenamesAreValid(filepath1) || !FilenamesAreValid(filepath2))
-    {
-        return ERROR_CODE;
-    }
-    if (!FilepathExists(filepath1) || !FilepathExists(filepath2))
+    ResolvedPath source;
+    ResolvedPath dest;
+    if (ResolvePath(filepath1, source) != 0 || !source.exists || ResolvePath(filepath2, dest) != 0 || !dest.exists)
     {
         return ERROR_CODE;
     }
 
-    dir_entry sourceDirEntry;
-    dir_entry destDirEntry;
-
-    StringVector parsedDestPath = ParseDirPath(filepath2);
-    GetDirEntry(ParseDirPath(filepath1), sourceDirEntry);
-    GetDirEntry(parsedDestPath, destDirEntry);
+    const dir_entry &sourceDirEntry = source.entry;
+    const dir_entry &destDirEntry = dest.entry;
 
     if (sourceDirEntry.type != TYPE_FILE || destDirEntry.type != TYPE_FILE)
     {
@@ -495,20 +494,28 @@ int FS::append(std::string filepath1, std::string filepath2)
         return ERROR_CODE;
     }
 
-    std::string fileContents = "";
-    if (ReadFileToDataString(fileContents, destDirEntry) != 0)
+    // Only the source is read and only the end of the destination is written, the rest of it is never touched.
+    const uint32_t sourceSize = sourceDirEntry.size;
+    const uint32_t destSize = destDirEntry.size;
+    if (sourceSize == 0)
     {
-        return ERROR_CODE;
+        return 0;
     }
-    if (ReadFileToDataString(fileContents, sourceDirEntry) != 0)
+    if (sourceSize > UINT32_MAX - destSize)
     {
         return ERROR_CODE;
     }
 
     {
-        int destBlockCount = CalculateMinBlockCount(destDirEntry.size);
-        int desiredNewBlockCount = CalculateMinBlockCount(fileContents.size());
-        // If new file contents are bigger than previous size.
+        // The last block is either topped up or linked to new blocks, so every block up to it has to be the destination's own.
+        const uint32_t destBlockCount = ExtentIndex::GetBlockCount(GetChainExtents(destDirEntry.first_blk));
+        if (UnshareChain(destDirEntry.first_blk, destBlockCount - 1) != 0)
+        {
+            return ERROR_CODE;
+        }
+
+        const uint32_t desiredNewBlockCount = CalculateMinBlockCount((uint64_t)destSize + sourceSize);
+        // If new file contents are bigger than the blocks file2 already has.
         if (desiredNewBlockCount > destBlockCount)
         {
             // Expand file2.
@@ -519,15 +526,69 @@ int FS::append(std::string filepath1, std::string filepath2)
         }
     }
 
-    dir_entry newDestDirEntry = destDirEntry;
-    newDestDirEntry.size = fileContents.size();
-    parsedDestPath.pop_back();
-    if (UpdateDirEntry(GetDirectoryBlock(parsedDestPath), destDirEntry, newDestDirEntry) != 0)
+    // A partly filled last block is topped up first, then the data continues in the blocks after it.
+    uint8_t tailBlockData[BLOCK_SIZE];
+    const uint32_t tailBytes = destSize % BLOCK_SIZE;
+    const int tailBlock = tailBytes != 0 ? GetChainBlock(destDirEntry.first_blk, destSize / BLOCK_SIZE) : FAT_EOF;
+    if (tailBytes != 0 && (tailBlock == FAT_EOF || m_cache.Read(tailBlock, tailBlockData) != 0))
+    {
+        return ERROR_CODE;
+    }
+
+    ChainWriter destWriter(*this, GetChainBlock(destDirEntry.first_blk, CalculateMinBlockCount(destSize)));
+    uint8_t *destData = tailBytes != 0 ? tailBlockData : nullptr;
+    uint32_t destDataUsed = tailBytes;
+    uint32_t bytesLeft = sourceSize;
+    // A source that is also the destination is only read up to its old size, which the writes never reach.
+    int result = ForEachChainBlock(sourceDirEntry.first_blk, [&](const uint8_t *sourceData)
+    {
+        uint32_t sourceDataLeft = std::min<uint32_t>(bytesLeft, BLOCK_SIZE);
+        bytesLeft -= sourceDataLeft;
+        while (sourceDataLeft > 0)
+        {
+            if (destData == nullptr || destDataUsed == BLOCK_SIZE)
+            {
+                if (destData == tailBlockData && m_cache.Write(tailBlock, tailBlockData) != 0)
+                {
+                    return ERROR_CODE;
+                }
+                destData = destWriter.NextBlock();
+                destDataUsed = 0;
+                if (destData == nullptr)
+                {
+                    return ERROR_CODE;
+                }
+            }
+
+            const uint32_t bytesToCopy = std::min(sourceDataLeft, BLOCK_SIZE - destDataUsed);
+            memcpy(destData + destDataUsed, sourceData, bytesToCopy);
+            sourceData += bytesToCopy;
+            sourceDataLeft -= bytesToCopy;
+            destDataUsed += bytesToCopy;
+        }
+
+        return bytesLeft == 0 ? 1 : 0;
+    });
+    if (result < 0 || bytesLeft > 0)
+    {
+        return ERROR_CODE;
+    }
+    if (destData == tailBlockData && m_cache.Write(tailBlock, tailBlockData) != 0)
+    {
+        return ERROR_CODE;
+    }
+    if (destWriter.Flush() != 0)
     {
         return ERROR_CODE;
     }
 
-    return WriteDataStringToFile(fileContents, newDestDirEntry);
+    dir_entry newDestDirEntry = destDirEntry;
+    newDestDirEntry.size = destSize + sourceSize;
+    if (UpdateDirEntry(dest, newDestDirEntry) != 0)
+    {
+        return ERROR_CODE;
+    }
+    return fatBatch.Flush();
 }
 
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
@@ -535,14 +596,14 @@ int FS::append(std::string filepath1, std::string filepath2)
 int FS::mkdir(std::string dirpath)
 {
     std::cout << "FS::mkdir(" << dirpath << ")\n";
+    FATBatch fatBatch(*this);
 
-    if (!FilenamesAreValid(dirpath) || FilepathExists(dirpath))
+    ResolvedPath newDirPath;
+    if (ResolvePath(dirpath, newDirPath) != 0 || newDirPath.exists)
     {
         return ERROR_CODE;
     }
-
-    std::vector<std::string> parsedFilePath = ParseDirPath(dirpath);
-    std::string dirName = parsedFilePath.back();
+    const std::string &dirName = newDirPath.name;
 
     int newDirBlock;
     if (AllocateNewFileOnFAT(1, &newDirBlock) != 0)
@@ -550,6 +611,13 @@ int FS::mkdir(std::string dirpath)
         return ERROR_CODE;
     }
 
+    // The block may still hold data of a removed file, and a directory block has to start out without entries.
+    uint8_t emptyBlock[BLOCK_SIZE] = {0};
+    if (m_cache.Write(newDirBlock, emptyBlock) != 0)
+    {
+        return ERROR_CODE;
+    }
+
     dir_entry newDir = {};
     strcpy(newDir.file_name, dirName.c_str());
     newDir.first_blk = newDirBlock;
@@ -557,8 +625,7 @@ int FS::mkdir(std::string dirpath)
     newDir.size = 0;
     newDir.type = TYPE_DIR;
 
-    parsedFilePath.pop_back();
-    int parentDirBlock = GetDirectoryBlock(parsedFilePath);
+    const int parentDirBlock = newDirPath.parentDirBlock;
     // Add dir entry to parent directory.
     if (AddNewDirEntry(parentDirBlock, newDir) != 0)
     {
@@ -581,7 +648,7 @@ int FS::mkdir(std::string dirpath)
     {
         return ERROR_CODE;
     }
-    return 0;
+    return fatBatch.Flush();
 }
 
 // cd <dirpath> changes the current (working) directory to the directory named <dirpath>
@@ -592,22 +659,36 @@ int FS::cd(std::string dirpath)
     if (dirpath == "/")
     {
         m_cwdBlock = ROOT_BLOCK;
+        m_cwdPath.clear();
         return 0;
     }
 
-    if (!FilenamesAreValid(dirpath))
+    ResolvedPath newCWD;
+    if (ResolvePath(dirpath, newCWD) != 0 || !newCWD.exists || newCWD.entry.type != TYPE_DIR)
     {
         return ERROR_CODE;
     }
 
-    dir_entry newCWD;
-    GetDirEntry(ParseDirPath(dirpath), newCWD);
-    if (!DirEntryExists(newCWD) || newCWD.type != TYPE_DIR)
+    // Directories form a tree, so the new path follows from the old one and the names that were walked.
+    const StringVector parsedPath = ParseDirPath(dirpath);
+    StringVector newCWDPath = parsedPath.front() == "" ? StringVector{} : m_cwdPath;
+    for (const std::string &name : parsedPath)
     {
-        return ERROR_CODE;
+        if (name == "..")
+        {
+            if (!newCWDPath.empty())
+            {
+                newCWDPath.pop_back();
+            }
+        }
+        else if (name != "" && name != ".")
+        {
+            newCWDPath.push_back(name);
+        }
     }
 
-    m_cwdBlock = newCWD.first_blk;
+    m_cwdBlock = newCWD.entry.first_blk;
+    m_cwdPath = std::move(newCWDPath);
 
     return 0;
 }
@@ -618,46 +699,14 @@ int FS::pwd()
 {
     std::cout << "FS::pwd()\n";
 
-    int currentBlock = m_cwdBlock;
-    StringVector filepath = {};
-    // This while loop goes through all directories backwards starting from CWD and saves the name of a parent dir entry
-    // that points to the same block as CWD. This repeats until root is hit.
-    while (currentBlock != ROOT_BLOCK)
-    {
-        dir_entry backRefEntry;
-        // Get parent directory.
-        if (GetDirEntry(currentBlock, "..", backRefEntry) != 0)
-        {
-            return ERROR_CODE;
-        }
-
-        dir_entry dirEntries[DIR_BLOCK_SIZE];
-        if (m_disk.read(backRefEntry.first_blk, (uint8_t *)dirEntries) != 0)
-        {
-            return ERROR_CODE;
-        }
-        // Loop through all entries in parent directory
-        for (dir_entry &dirEntry : dirEntries)
-        {
-            if (dirEntry.first_blk == currentBlock) // Find dir entry in parent folder that points to current dir.
-            {
-                filepath.push_back("/" + (std::string)dirEntry.file_name);
-                break;
-            }
-        }
-
-        // Change CWD to parent directory.
-        currentBlock = backRefEntry.first_blk;
-    }
-
+    // The path is kept up to date by cd and rm, so nothing has to be read.
     std::string pwdOutput = "";
-    // Because we are going from a dir to root instead of root to dir, we reverse the order that we append to the string.
-    for (int i = filepath.size() - 1; i >= 0; i--)
+    for (const std::string &dirName : m_cwdPath)
     {
-        pwdOutput.append(filepath[i]);
+        pwdOutput.append("/" + dirName);
     }
 
-    // If block started at root, the output string should be empty. If so, add the root directory character.
+    // If CWD is root, the output string should be empty. If so, add the root directory character.
     if (pwdOutput.empty())
     {
         pwdOutput = "/";
@@ -676,377 +725,2331 @@ int FS::chmod(std::string accessrights, std::string filepath)
 {
     std::cout << "FS::chmod(" << accessrights << "," << filepath << ")\n";
 
-    if (!FilenamesAreValid(filepath) || !FilepathExists(filepath))
+    ResolvedPath file;
+    if (ResolvePath(filepath, file) != 0 || !file.exists)
     {
         return ERROR_CODE;
     }
 
-    const int accessRightsValue = std::stoi(accessrights);
+    // Only digits are converted, anything else would make std::stoul throw.
+    if (accessrights.empty() || accessrights.size() > 9 || accessrights.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return ERROR_CODE;
+    }
+    const unsigned long accessRightsValue = std::stoul(accessrights);
     // Validate access rights value.
-    if (accessRightsValue > (READ | WRITE | EXECUTE) || accessRightsValue < 0)
+    if (accessRightsValue > (READ | WRITE | EXECUTE))
     {
         return ERROR_CODE;
     }
 
-    dir_entry dirEntry;
-    StringVector parsedFilepath = ParseDirPath(filepath);
-    GetDirEntry(parsedFilepath, dirEntry);
+    dir_entry newDirEntry = file.entry;
+    newDirEntry.access_rights = (uint8_t)accessRightsValue;
+    return UpdateDirEntry(file, newDirEntry);
+}
+
+// sync writes all modified blocks held in memory back to the disk
+int FS::sync()
+{
+    std::cout << "FS::sync()\n";
+
+    // FAT blocks are only left dirty outside a batch when writing them failed, they are written again here.
+    int result = UpdateFAT();
+    result = ZeroFreedBlocks() != 0 ? ERROR_CODE : result;
+    return m_cache.Sync() != 0 ? ERROR_CODE : result;
+}
+
+// stats prints the block cache and async I/O counters
+int FS::stats()
+{
+    std::cout << "FS::stats()\n";
+
+    const BlockCache::Stats &cacheStats = m_cache.GetStats();
+    const uint64_t lookups = cacheStats.hits + cacheStats.misses;
+    const uint64_t hitRate = lookups == 0 ? 0 : cacheStats.hits * 100 / lookups;
+
+    std::cout << "freed blocks waiting to be zeroed: " << m_needsZeroCount << "\n";
+    std::cout << "cache: " << m_cache.GetSize() << "/" << m_cache.GetCapacity() << " blocks, "
+              << m_cache.GetDirtyCount() << " dirty\n";
+    std::cout << "hits: " << cacheStats.hits << " misses: " << cacheStats.misses << " (" << hitRate << "% hit rate)\n";
+    std::cout << "evictions: " << cacheStats.evictions << " writebacks: " << cacheStats.writebacks << std::endl;
+
+    const DentryCache::Stats &dentryStats = m_dentryCache.GetStats();
+    const uint64_t dentryLookups = dentryStats.hits + dentryStats.misses;
+    std::cout << "dentries: " << m_dentryCache.GetSize() << " cached, " << dentryStats.hits << " hits ("
+              << dentryStats.negativeHits << " negative), " << dentryStats.misses << " misses ("
+              << (dentryLookups == 0 ? 0 : dentryStats.hits * 100 / dentryLookups) << "% hit rate), "
+              << dentryStats.evictions << " evictions" << std::endl;
+
+    std::cout << "readahead: " << m_readaheadStats.windows << " windows, " << m_readaheadStats.blocks << " blocks, "
+              << m_readaheadStats.unused << " unused" << std::endl;
+
+    if (m_aio == nullptr)
+    {
+        std::cout << "async I/O: disabled" << std::endl;
+        return 0;
+    }
+
+    const AsyncIO::Stats aioStats = m_aio->GetStats();
+    const uint64_t requestCount = aioStats.reads + aioStats.writes;
+    std::cout << "async I/O: " << m_aio->GetBackendName() << ", queue depth " << m_aio->GetQueueDepth()
+              << ", max in flight " << aioStats.maxInFlight << "\n";
+    std::cout << "requests: " << aioStats.reads << " reads, " << aioStats.writes << " writes, " << aioStats.blocks << " blocks\n";
+    std::cout << "latency: " << (requestCount == 0 ? 0 : aioStats.totalLatencyUs / requestCount) << " us avg, "
+              << aioStats.maxLatencyUs << " us max" << std::endl;
+    return 0;
+}
 
-    parsedFilepath.pop_back();
-    int parentDirectoryBlock = GetDirectoryBlock(parsedFilepath);
+// df prints how many blocks are used and free on the disk
+int FS::df()
+{
+    std::cout << "FS::df()\n";
 
-    dir_entry newDirEntry = dirEntry;
-    newDirEntry.access_rights = accessRightsValue;
-    UpdateDirEntry(parentDirectoryBlock, dirEntry, newDirEntry);
+    const unsigned totalBlocks = m_freeMap.GetBlockCount();
+    const unsigned freeBlocks = m_freeMap.GetFreeCount();
+    const unsigned usedBlocks = totalBlocks - freeBlocks;
 
+    std::cout << "Blocks\tUsed\tFree\tUse%\n";
+    std::cout << totalBlocks << "\t" << usedBlocks << "\t" << freeBlocks << "\t"
+              << (totalBlocks == 0 ? 0 : usedBlocks * 100 / totalBlocks) << "%\n";
+    std::cout << "Free space: " << (uint64_t)freeBlocks * BLOCK_SIZE << " bytes" << std::endl;
     return 0;
 }
 
-int FS::MakeFATEntry(const uint32_t index, const int16_t blockValue)
+// extents <filepath> prints how many blocks the file uses and how many contiguous runs they form
+int FS::extents(std::string filepath)
 {
-    // Error handling
+    std::cout << "FS::extents(" << filepath << ")\n";
+
+    ResolvedPath file;
+    if (ResolvePath(filepath, file) != 0 || !file.exists)
+    {
+        return ERROR_CODE;
+    }
+
+    const dir_entry &dirEntry = file.entry;
+    const ExtentList &extents = GetChainExtents(dirEntry.first_blk);
+    std::cout << dirEntry.file_name << ": " << ExtentIndex::GetBlockCount(extents) << " blocks in " << extents.size() << " extents" << std::endl;
+    return 0;
+}
+
+// defrag [budget] moves fragmented files into contiguous runs of free blocks, most fragmented first
+int FS::defrag(unsigned blockBudget)
+{
+    std::cout << "FS::defrag(" << blockBudget << ")\n";
+    FATBatch fatBatch(*this);
+
+    std::vector<ResolvedPath> entries;
+    if (CollectEntries(ROOT_BLOCK, entries) != 0)
     {
-        static bool rootCreated = false;
-        static bool FATCreated = false;
+        return ERROR_CODE;
+    }
 
-        if (index == ROOT_BLOCK)
+    // Directories are left where they are, since ".." entries and the CWD point at their first block.
+    std::vector<std::pair<size_t, ResolvedPath>> fragmentedFiles;
+    for (const ResolvedPath &location : entries)
+    {
+        // Open files are skipped, their handles hold on to the blocks. So are files sharing blocks with copies,
+        // moving them would give every copy blocks of its own.
+        const size_t extentCount = GetChainExtents(location.entry.first_blk).size();
+        if (location.entry.type == TYPE_FILE && extentCount > 1 && !FileIsOpen(location.entry.first_blk) &&
+            GetFirstSharedBlock(location.entry.first_blk) == FAT_EOF)
         {
-            if (rootCreated)
-            {
-                return ERROR_CODE;
-            }
-            rootCreated = true;
+            fragmentedFiles.push_back({extentCount, location});
+        }
+    }
+    std::stable_sort(fragmentedFiles.begin(), fragmentedFiles.end(),
+                     [](const std::pair<size_t, ResolvedPath> &a, const std::pair<size_t, ResolvedPath> &b) { return a.first > b.first; });
+
+    unsigned movedFiles = 0;
+    uint64_t movedBlocks = 0;
+    size_t extentsBefore = 0;
+    size_t extentsAfter = 0;
+    // Time the copies spend reading the fragmented chains and writing the contiguous ones.
+    std::chrono::duration<double> readTime(0);
+    std::chrono::duration<double> writeTime(0);
+    for (const auto &fragmentedFile : fragmentedFiles)
+    {
+        const dir_entry &oldDirEntry = fragmentedFile.second.entry;
+        const uint32_t blockCount = ExtentIndex::GetBlockCount(GetChainExtents(oldDirEntry.first_blk));
+
+        // A file that does not fit in what is left of the budget is left for a later pass,
+        // but every pass moves at least one file so a small budget still makes progress.
+        if (blockBudget != 0 && movedBlocks > 0 && movedBlocks + blockCount > blockBudget)
+        {
+            continue;
+        }
+        // Moving the file only helps if a single free run can hold all of it.
+        if (m_freeMap.FindBestFitRun(blockCount) == -1)
+        {
+            continue;
+        }
+
+        int newFirstBlock;
+        if (AllocateNewFileOnFAT(blockCount, &newFirstBlock) != 0)
+        {
+            return ERROR_CODE;
         }
 
-        if (index == FAT_BLOCK)
+        // The time between two blocks handed out is spent reading the old chain, the rest writing the new one.
+        ChainWriter newChainWriter(*this, newFirstBlock);
+        auto blockDone = std::chrono::steady_clock::now();
+        int result = ForEachChainBlock(oldDirEntry.first_blk, [&](const uint8_t *oldData)
         {
-            if (FATCreated)
+            const auto blockRead = std::chrono::steady_clock::now();
+            readTime += blockRead - blockDone;
+            uint8_t *newData = newChainWriter.NextBlock(false);
+            if (newData == nullptr)
             {
                 return ERROR_CODE;
             }
-            FATCreated = true;
+            memcpy(newData, oldData, BLOCK_SIZE);
+            blockDone = std::chrono::steady_clock::now();
+            writeTime += blockDone - blockRead;
+            return 0;
+        });
+        const auto flushStart = std::chrono::steady_clock::now();
+        result = result != 0 ? result : newChainWriter.Flush();
+        writeTime += std::chrono::steady_clock::now() - flushStart;
+        if (result != 0)
+        {
+            // The old chain is still intact and in use, only give back the new one.
+            FreeChain(newFirstBlock);
+            return ERROR_CODE;
         }
 
-        if (index > FAT_SIZE || index < 0)
+        dir_entry newDirEntry = oldDirEntry;
+        newDirEntry.first_blk = newFirstBlock;
+        if (UpdateDirEntry(fragmentedFile.second, newDirEntry) != 0 || FreeChain(oldDirEntry.first_blk) != 0)
         {
             return ERROR_CODE;
         }
-    }
 
-    m_fat[index] = blockValue;
+        movedFiles++;
+        movedBlocks += blockCount;
+        extentsBefore += fragmentedFile.first;
+        extentsAfter += GetChainExtents(newFirstBlock).size();
+    }
 
-    return UpdateFAT(); // Updates FAT on disk automatically upon returning.
+    const double movedMegabytes = movedBlocks * BLOCK_SIZE / (1024.0 * 1024.0);
+    std::cout << "Moved " << movedFiles << " of " << fragmentedFiles.size() << " fragmented files, "
+              << movedBlocks << " blocks\n";
+    std::cout << "Extents: " << extentsBefore << " before, " << extentsAfter << " after ("
+              << extentsBefore - extentsAfter << " removed)\n";
+    // Copies from memory can finish faster than the clock resolution, there is no throughput to report then.
+    if (movedFiles > 0 && readTime.count() > 0 && writeTime.count() > 0)
+    {
+        std::cout << "Copy throughput: " << movedMegabytes / readTime.count() << " MB/s reading fragmented, "
+                  << movedMegabytes / writeTime.count() << " MB/s writing contiguous" << std::endl;
+    }
+    return fatBatch.Flush();
 }
 
-int FS::UpdateFAT()
+// fsck [repair] checks the directory tree and the FAT for problems and fixes them if repair is set
+int FS::fsck(bool repair)
 {
-    // FAT has a size of BLOCK_SIZE so this will fill the whole block.
-    return m_disk.write(FAT_BLOCK, (uint8_t *)m_fat);
-}
+    std::cout << "FS::fsck(" << (repair ? "repair" : "") << ")\n";
+    const auto checkStart = std::chrono::steady_clock::now();
 
-int FS::AddNewDirEntry(const int parentDirectoryBlock, const dir_entry &newDirEntry)
-{
-    if (!DirEntryExists(newDirEntry))
+    if (m_blockCount == 0)
     {
+        std::cout << "No file system to check, use format to initialize one" << std::endl;
         return ERROR_CODE;
-    } // Return if name is empty.
+    }
 
-    dir_entry dirEntries[DIR_BLOCK_SIZE];
-    if (m_disk.read(parentDirectoryBlock, (uint8_t *)dirEntries) != 0)
+    // The workers read directory blocks straight from the disk, so everything in the cache has to be written first.
+    if (m_cache.Sync() != 0)
     {
         return ERROR_CODE;
     }
 
-    bool foundEmptyDirEntry = false;
-    for (dir_entry &dirEntry : dirEntries)
+    FsckState state(m_blockCount);
+    state.pendingDirs.push_back({ROOT_BLOCK, ROOT_BLOCK});
+    state.visitedDirs[ROOT_BLOCK] = true;
+
+    // No entry points at the root directory, so the blocks it has grown into are claimed for it up front.
+    uint32_t rootBlockCount;
+    if (m_fat[ROOT_BLOCK] != FAT_EOF && !FsckClaimChain(state, FSCK_ROOT_ID, m_fat[ROOT_BLOCK], false, 0, rootBlockCount))
     {
-        // If we found a spot where a dir entry does not exists we found a free spot.
-        if (!DirEntryExists(dirEntry))
-        {
-            dirEntry = newDirEntry;
-            foundEmptyDirEntry = true;
-            break;
-        }
+        state.badChains++;
     }
 
-    return foundEmptyDirEntry ? m_disk.write(parentDirectoryBlock, (uint8_t *)dirEntries) : ERROR_CODE;
-}
-
-int FS::AllocateNewFileOnFAT(const int nBlocksToAllocate, int *const allocatedFirstBlock)
+    // Walk the tree and claim the chain of every entry found on the way.
+    const unsigned threadCount = std::max(1u, std::min(FSCK_MAX_THREADS, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        workers.emplace_back(&FS::FsckWorker, this, std::ref(state));
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    if (state.readFailed)
+    {
+        return ERROR_CODE;
+    }
+
+    // Blocks in use according to the FAT that no entry has claimed are leaked. The FAT is split between the threads.
+    std::atomic<uint64_t> leakedBlocks{0};
+    const uint32_t rangeSize = (m_blockCount - m_reservedBlocks + threadCount - 1) / threadCount;
+    workers.clear();
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        workers.emplace_back([this, &state, &leakedBlocks, rangeSize, i]()
+        {
+            const uint64_t rangeStart = m_reservedBlocks + (uint64_t)i * rangeSize;
+            const uint64_t rangeEnd = std::min<uint64_t>(m_blockCount, rangeStart + rangeSize);
+            uint64_t leakedInRange = 0;
+            for (uint64_t block = rangeStart; block < rangeEnd; block++)
+            {
+                if (m_fat[block] != FAT_FREE && state.owners[block] == 0)
+                {
+                    leakedInRange++;
+                }
+            }
+            leakedBlocks += leakedInRange;
+        });
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    const auto checkTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - checkStart);
+    const uint64_t problemCount = state.crossLinkedBlocks + state.badChains + state.badEntries + state.sizeMismatches +
+                                  state.badParentRefs.size() + leakedBlocks;
+
+    std::cout << state.directories << " directories, " << state.files << " files, " << state.usedBlocks << " blocks in use\n";
+    std::cout << "cross-linked blocks: " << state.crossLinkedBlocks << "\n";
+    std::cout << "broken chains: " << state.badChains << "\n";
+    std::cout << "invalid dir entries: " << state.badEntries << "\n";
+    std::cout << "files with more or fewer blocks than their size: " << state.sizeMismatches << "\n";
+    std::cout << "wrong \"..\" entries: " << state.badParentRefs.size() << "\n";
+    std::cout << "leaked blocks: " << leakedBlocks << "\n";
+    std::cout << "Checked in " << checkTime.count() / 1000.0 << " ms with " << threadCount << " threads, "
+              << (problemCount == 0 ? "no problems found" : std::to_string(problemCount) + " problems found") << std::endl;
+
+    if (!repair || problemCount == 0)
+    {
+        return 0;
+    }
+    // Repairs can cut or remove files, which open handles would not notice.
+    if (OpenFileCount() > 0)
+    {
+        std::cout << "Close all open files before repairing" << std::endl;
+        return ERROR_CODE;
+    }
+    if (FsckRepair(state) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    std::cout << "Repaired, run fsck again to check the result" << std::endl;
+    return 0;
+}
+
+// open opens an existing file for reading and/or writing and returns its file descriptor
+int FS::open(std::string filepath, int mode)
 {
-    std::vector<int> freeBlocksArray;
-    if (GetFreeBlocks(nBlocksToAllocate, freeBlocksArray) != 0)
+    if (mode == 0 || (mode & ~(READ | WRITE)) != 0)
     {
         return ERROR_CODE;
     }
 
-    // Go through the available blocks and insert correct flags and linkage.
-    for (int i = 0; i < nBlocksToAllocate; i++)
+    ResolvedPath file;
+    if (ResolvePath(filepath, file) != 0 || !file.exists)
+    {
+        return ERROR_CODE;
+    }
+    if (file.entry.type != TYPE_FILE || !HasValidAccess(file.entry, mode))
+    {
+        return ERROR_CODE;
+    }
+
+    // The lowest free descriptor is handed out, like on Unix.
+    size_t fd = 0;
+    while (fd < m_openFiles.size() && m_openFiles[fd].isOpen)
+    {
+        fd++;
+    }
+    if (fd == MAX_OPEN_FILES)
+    {
+        return ERROR_CODE;
+    }
+    if (fd == m_openFiles.size())
+    {
+        m_openFiles.emplace_back();
+    }
+
+    OpenFile &openFile = m_openFiles[fd];
+    openFile = {};
+    openFile.isOpen = true;
+    openFile.mode = (uint8_t)mode;
+    openFile.dirBlock = file.parentDirBlock;
+    openFile.slot = file.slot;
+    openFile.firstBlock = file.entry.first_blk;
+    return (int)fd;
+}
+
+// pread reads up to count bytes from offset without moving the file position
+int FS::pread(int fd, uint8_t *buf, uint32_t count, uint32_t offset)
+{
+    OpenFile *file = GetOpenFile(fd);
+    ResolvedPath entry;
+    if (file == nullptr || (file->mode & READ) == 0 || GetOpenFileEntry(*file, entry) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    const uint32_t size = entry.entry.size;
+    if (offset >= size || count == 0)
+    {
+        return 0;
+    }
+    count = std::min<uint32_t>({count, size - offset, INT32_MAX});
+
+    // A read that does not continue where the last one ended is random access, which reads less ahead.
+    if (offset != file->nextReadOffset)
+    {
+        file->readaheadWindow = std::max<unsigned>(file->readaheadWindow / 2, READAHEAD_MIN_BLOCKS);
+    }
+    file->nextReadOffset = offset + count;
+
+    const uint32_t firstBlock = offset / BLOCK_SIZE;
+    const uint32_t lastBlock = (offset + count - 1) / BLOCK_SIZE;
+    uint32_t bytesRead = 0;
+    // Copies the part of a block that falls into the range. Returns 1 once the range is complete.
+    auto copyBlock = [&](const uint8_t *blockData)
+    {
+        const uint32_t blockOffset = (offset + bytesRead) % BLOCK_SIZE;
+        const uint32_t bytesToCopy = std::min<uint32_t>(count - bytesRead, BLOCK_SIZE - blockOffset);
+        memcpy(buf + bytesRead, blockData + blockOffset, bytesToCopy);
+        bytesRead += bytesToCopy;
+        return bytesRead == count ? 1 : 0;
+    };
+
+    // A few blocks are taken from the cache, longer ranges are read ahead in batches past it.
+    if (lastBlock - firstBlock < CACHED_IO_MAX_BLOCKS)
+    {
+        for (uint32_t logicalBlock = firstBlock; logicalBlock <= lastBlock; logicalBlock++)
+        {
+            const int block = GetFileBlock(*file, logicalBlock);
+            const uint8_t *blockData = block != FAT_EOF ? m_cache.Peek(block) : nullptr;
+            if (blockData == nullptr)
+            {
+                return ERROR_CODE;
+            }
+            copyBlock(blockData);
+        }
+        return (int)bytesRead;
+    }
+
+    const int startBlock = GetFileBlock(*file, firstBlock);
+    if (startBlock == FAT_EOF)
+    {
+        return ERROR_CODE;
+    }
+    {
+        // Blocks past the range would only be read into the reader's buffers and thrown away.
+        ChainReader reader(*this, startBlock, file->readaheadWindow, lastBlock - firstBlock + 1);
+        const uint8_t *blockData = reader.NextBlock();
+        while (blockData != nullptr && copyBlock(blockData) == 0)
+        {
+            blockData = reader.NextBlock();
+        }
+        file->readaheadWindow = reader.GetWindow();
+        if (blockData == nullptr)
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    // The next sequential call continues from here.
+    GetFileBlock(*file, lastBlock);
+    return (int)bytesRead;
+}
+
+// pwrite writes count bytes at offset without moving the file position, growing the file if needed
+int FS::pwrite(int fd, const uint8_t *buf, uint32_t count, uint32_t offset)
+{
+    OpenFile *file = GetOpenFile(fd);
+    ResolvedPath entry;
+    if (file == nullptr || (file->mode & WRITE) == 0 || GetOpenFileEntry(*file, entry) != 0)
+    {
+        return ERROR_CODE;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (count > INT32_MAX || (uint64_t)offset + count > UINT32_MAX)
+    {
+        return ERROR_CODE;
+    }
+
+    const uint32_t newSize = std::max<uint32_t>(entry.entry.size, offset + count);
+    return WriteFileRange(*file, entry, buf, offset, count, newSize) == 0 ? (int)count : ERROR_CODE;
+}
+
+// read reads up to count bytes from the file position and moves the position past them
+int FS::read(int fd, uint8_t *buf, uint32_t count)
+{
+    OpenFile *file = GetOpenFile(fd);
+    if (file == nullptr)
+    {
+        return ERROR_CODE;
+    }
+
+    const int bytesRead = pread(fd, buf, count, file->position);
+    if (bytesRead > 0)
+    {
+        file->position += bytesRead;
+    }
+    return bytesRead;
+}
+
+// write writes count bytes at the file position and moves the position past them
+int FS::write(int fd, const uint8_t *buf, uint32_t count)
+{
+    OpenFile *file = GetOpenFile(fd);
+    if (file == nullptr)
+    {
+        return ERROR_CODE;
+    }
+
+    const int bytesWritten = pwrite(fd, buf, count, file->position);
+    if (bytesWritten > 0)
+    {
+        file->position += bytesWritten;
+    }
+    return bytesWritten;
+}
+
+// lseek moves the file position of fd and returns the new position
+int64_t FS::lseek(int fd, int64_t offset, int whence)
+{
+    OpenFile *file = GetOpenFile(fd);
+    ResolvedPath entry;
+    if (file == nullptr || GetOpenFileEntry(*file, entry) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    int64_t newPosition;
+    switch (whence)
+    {
+    case SEEK_SET:
+        newPosition = offset;
+        break;
+
+    case SEEK_CUR:
+        newPosition = (int64_t)file->position + offset;
+        break;
+
+    case SEEK_END:
+        newPosition = (int64_t)entry.entry.size + offset;
+        break;
+
+    default:
+        return ERROR_CODE;
+    }
+
+    // Seeking past the end is allowed, a write there fills the gap with zeros.
+    if (newPosition < 0 || newPosition > UINT32_MAX)
+    {
+        return ERROR_CODE;
+    }
+    file->position = (uint32_t)newPosition;
+    return newPosition;
+}
+
+// truncate cuts the file of fd to length bytes or grows it with zeros
+int FS::truncate(int fd, uint32_t length)
+{
+    OpenFile *file = GetOpenFile(fd);
+    ResolvedPath entry;
+    if (file == nullptr || (file->mode & WRITE) == 0 || GetOpenFileEntry(*file, entry) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    const uint32_t size = entry.entry.size;
+    if (length >= size)
+    {
+        return length == size ? 0 : WriteFileRange(*file, entry, nullptr, length, 0, length);
+    }
+
+    FATBatch fatBatch(*this);
+
+    // A file always keeps its first block, even when it becomes empty.
+    // The last kept block is cut from the rest of the chain and zeroed past the end, so it has to be the file's own.
+    const uint32_t keptBlocks = std::max<uint32_t>(1, CalculateMinBlockCount(length));
+    if (UnshareFileBlocks(*file, keptBlocks - 1) != 0)
+    {
+        return ERROR_CODE;
+    }
+    const int lastKeptBlock = GetChainBlock(file->firstBlock, keptBlocks - 1);
+    if (lastKeptBlock == FAT_EOF)
+    {
+        return ERROR_CODE;
+    }
+    const int firstCutBlock = GetChildBlock(lastKeptBlock);
+    if (firstCutBlock != FAT_EOF && (MakeFATEntry(lastKeptBlock, FAT_EOF) != 0 || FreeChain(firstCutBlock) != 0))
+    {
+        return ERROR_CODE;
+    }
+
+    // Bytes past the size are always zero, so a later write past the end does not bring old data back.
+    const uint32_t tailBytes = length % BLOCK_SIZE;
+    if (tailBytes != 0 || length == 0)
+    {
+        uint8_t blockData[BLOCK_SIZE];
+        if (m_cache.Read(lastKeptBlock, blockData) != 0)
+        {
+            return ERROR_CODE;
+        }
+        memset(blockData + tailBytes, 0, BLOCK_SIZE - tailBytes);
+        if (m_cache.Write(lastKeptBlock, blockData) != 0)
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    // Blocks cached by any handle of the file may have been freed.
+    ForgetCachedBlocks(file->firstBlock);
+
+    dir_entry newDirEntry = entry.entry;
+    newDirEntry.size = length;
+    if (UpdateDirEntry(entry, newDirEntry) != 0)
+    {
+        return ERROR_CODE;
+    }
+    return fatBatch.Flush();
+}
+
+// close closes the file descriptor fd
+int FS::close(int fd)
+{
+    OpenFile *file = GetOpenFile(fd);
+    if (file == nullptr)
+    {
+        return ERROR_CODE;
+    }
+
+    file->isOpen = false;
+    return 0;
+}
+
+int FS::Mount()
+{
+    const auto mountStart = std::chrono::steady_clock::now();
+
+    // Nothing is free until a valid FAT has been loaded.
+    SetupFAT(0);
+
+    uint8_t superBlockData[BLOCK_SIZE];
+    if (m_cache.Read(SUPER_BLOCK, superBlockData) != 0)
+    {
+        return ERROR_CODE;
+    }
+    super_block superBlock;
+    memcpy(&superBlock, superBlockData, sizeof(superBlock));
+
+    bool isValid = superBlock.magic == FS_MAGIC && superBlock.version == FS_VERSION &&
+                   superBlock.block_count <= m_disk.get_no_blocks() && superBlock.fat_start == FAT_START_BLOCK &&
+                   SetupFAT(superBlock.block_count) == 0 && superBlock.fat_blocks == m_reservedBlocks - FAT_START_BLOCK;
+
+    // The FAT blocks are adjacent and read with one batched read straight into m_fat.
+    if (isValid)
+    {
+        std::vector<block_io> fatBlocks;
+        for (uint32_t fatBlock = 0; fatBlock < superBlock.fat_blocks; fatBlock++)
+        {
+            fatBlocks.push_back({FAT_START_BLOCK + fatBlock, (uint8_t *)(m_fat.data() + fatBlock * FAT_ENTRIES_PER_BLOCK)});
+        }
+        isValid = m_cache.ReadBlocks(fatBlocks) == 0;
+    }
+
+    // The root directory is the only reserved block that can continue in a data block, it is checked with them.
+    for (uint32_t block = 0; block < m_reservedBlocks && isValid; block++)
+    {
+        isValid = m_fat[block] == FAT_EOF || (block == ROOT_BLOCK && m_fat[block] != FAT_FREE);
+    }
+
+    // Validate every entry, collect the free blocks and count the links to every block in one pass.
+    // A block linked from several blocks is shared by copies of a file, fsck checks that only files share blocks.
+    for (uint32_t block = ROOT_BLOCK; block < m_blockCount && isValid; block = block == ROOT_BLOCK ? m_reservedBlocks : block + 1)
+    {
+        const int32_t blockValue = m_fat[block];
+        if (blockValue == FAT_FREE)
+        {
+            m_freeMap.SetFree(block, true);
+            continue;
+        }
+        if (blockValue == FAT_EOF)
+        {
+            continue;
+        }
+
+        // Children can never be root, superblock, FAT, the block itself or outside the file system.
+        if (blockValue < (int32_t)m_reservedBlocks || (uint32_t)blockValue >= m_blockCount || (uint32_t)blockValue == block)
+        {
+            isValid = false;
+        }
+        else if (++m_linkCounts[blockValue] == 2)
+        {
+            m_sharedBlockCount++;
+        }
+    }
+
+    // A used block linked from another block has to be part of a chain, i.e. not marked as free.
+    for (uint32_t block = m_reservedBlocks; block < m_blockCount && isValid; block++)
+    {
+        if (m_linkCounts[block] > 0 && m_fat[block] == FAT_FREE)
+        {
+            isValid = false;
+        }
+    }
+
+    // Every chain has to end in FAT_EOF, a loop would make every walk over the chain spin forever. Chains are walked
+    // from their first block, which no block links to, and a used block no walk reaches can only be part of a loop.
+    // Copies share the tail of a chain, so a walk stops at a block an earlier walk reached, as that walk already
+    // found FAT_EOF past it, and every block is walked once. A block the same walk reaches twice is a loop, which
+    // runs the walk past m_blockCount blocks.
+    std::vector<uint32_t> reachedFrom(m_blockCount, m_blockCount);
+    for (uint32_t firstBlock = ROOT_BLOCK; firstBlock < m_blockCount && isValid;
+         firstBlock = firstBlock == ROOT_BLOCK ? m_reservedBlocks : firstBlock + 1)
+    {
+        if (m_fat[firstBlock] == FAT_FREE || m_linkCounts[firstBlock] > 0)
+        {
+            continue;
+        }
+
+        uint32_t chainLength = 0;
+        for (int32_t block = firstBlock; block != FAT_EOF && isValid; block = m_fat[block])
+        {
+            if (reachedFrom[block] != m_blockCount && reachedFrom[block] != firstBlock)
+            {
+                break;
+            }
+            reachedFrom[block] = firstBlock;
+            isValid = ++chainLength <= m_blockCount;
+        }
+    }
+    for (uint32_t block = m_reservedBlocks; block < m_blockCount && isValid; block++)
+    {
+        if (m_fat[block] != FAT_FREE && reachedFrom[block] == m_blockCount)
+        {
+            isValid = false;
+        }
+    }
+
+    const auto mountTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mountStart);
+    if (!isValid)
+    {
+        SetupFAT(0);
+        std::cout << "FS::Mount()... No valid FAT found on disk, use format to initialize the file system\n";
+        return ERROR_CODE;
+    }
+
+    std::cout << "FS::Mount()... Mounted in " << mountTime.count() / 1000.0 << " ms, "
+              << m_freeMap.GetFreeCount() << " of " << m_blockCount << " blocks free\n";
+    return 0;
+}
+
+int FS::MakeFATEntry(const uint32_t index, const int32_t blockValue)
+{
+    // Error handling
+    {
+        if (index >= m_blockCount)
+        {
+            return ERROR_CODE;
+        }
+
+        // Root, superblock and FAT blocks are always in use. Only the root directory may grow into other blocks.
+        if (index < m_reservedBlocks && blockValue != FAT_EOF && (index != ROOT_BLOCK || blockValue == FAT_FREE))
+        {
+            return ERROR_CODE;
+        }
+
+        if (blockValue > 0 && (uint32_t)blockValue >= m_blockCount)
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    // The block the entry linked to loses a link and the new one gains one.
+    if (m_fat[index] > 0 && --m_linkCounts[m_fat[index]] == 1)
+    {
+        m_sharedBlockCount--;
+        m_shareGeneration++;
+    }
+    if (blockValue > 0 && ++m_linkCounts[blockValue] == 2)
+    {
+        m_sharedBlockCount++;
+        m_shareGeneration++;
+    }
+
+    m_fat[index] = blockValue;
+    m_freeMap.SetFree(index, blockValue == FAT_FREE);
+    // A block that is taken again gets new data from its new owner, so it no longer has to be zeroed.
+    if (blockValue != FAT_FREE && m_needsZero[index])
+    {
+        m_needsZero[index] = false;
+        m_needsZeroCount--;
+    }
+    m_extentIndex.InvalidateBlock(index);
+    MarkFATBlockDirty(index / FAT_ENTRIES_PER_BLOCK);
+
+    // Inside a batch the FAT is written once when the batch ends.
+    return m_fatBatchDepth > 0 ? 0 : UpdateFAT();
+}
+
+void FS::MarkFATBlockDirty(const uint32_t fatBlock)
+{
+    if (!m_fatBlockDirty[fatBlock])
+    {
+        m_fatBlockDirty[fatBlock] = true;
+        m_dirtyFATBlocks.push_back(fatBlock);
+    }
+}
+
+int FS::UpdateFAT()
+{
+    if (m_dirtyFATBlocks.empty())
+    {
+        return 0;
+    }
+
+    std::vector<block_io> fatBlocks;
+    fatBlocks.reserve(m_dirtyFATBlocks.size());
+    for (const uint32_t fatBlock : m_dirtyFATBlocks)
+    {
+        fatBlocks.push_back({FAT_START_BLOCK + fatBlock, (uint8_t *)(m_fat.data() + fatBlock * FAT_ENTRIES_PER_BLOCK)});
+    }
+
+    // A few changed FAT blocks stay in the cache until they are written back. Larger changes, like a format
+    // of a big disk, are written straight away in one batch instead of pushing everything else out of the cache.
+    int result = 0;
+    if (fatBlocks.size() > m_cache.GetCapacity() / 2)
+    {
+        result = m_cache.WriteBlocks(fatBlocks);
+    }
+    else
+    {
+        for (const block_io &io : fatBlocks)
+        {
+            if (m_cache.Write(io.block_no, io.buf) != 0)
+            {
+                result = ERROR_CODE;
+                break;
+            }
+        }
+    }
+    if (result != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    for (const uint32_t fatBlock : m_dirtyFATBlocks)
+    {
+        m_fatBlockDirty[fatBlock] = false;
+    }
+    m_dirtyFATBlocks.clear();
+    return 0;
+}
+
+int FS::SetupFAT(const uint32_t blockCount)
+{
+    const uint32_t fatBlockCount = (blockCount + FAT_ENTRIES_PER_BLOCK - 1) / FAT_ENTRIES_PER_BLOCK;
+    const bool isValid = blockCount >= MIN_FS_BLOCKS && blockCount <= MAX_FS_BLOCKS &&
+                         FAT_START_BLOCK + fatBlockCount < blockCount;
+
+    // An invalid size leaves a file system without any blocks, i.e. one that needs a format.
+    m_blockCount = isValid ? blockCount : 0;
+    m_reservedBlocks = isValid ? FAT_START_BLOCK + fatBlockCount : 0;
+    m_fat.assign(isValid ? fatBlockCount * FAT_ENTRIES_PER_BLOCK : 0, FAT_FREE);
+    m_fatBlockDirty.assign(isValid ? fatBlockCount : 0, false);
+    m_dirtyFATBlocks.clear();
+    m_freeMap.Reset(m_blockCount);
+    m_linkCounts.assign(m_blockCount, 0);
+    m_sharedBlockCount = 0;
+    m_extentIndex.Clear();
+    m_dirIndexes.clear();
+    m_dentryCache.Clear();
+    m_dirParents.clear();
+    m_needsZero.assign(m_blockCount, false);
+    m_needsZeroCount = 0;
+
+    return isValid ? 0 : ERROR_CODE;
+}
+
+FS::FATBatch::FATBatch(FS &fs) : m_fs(fs)
+{
+    m_fs.m_fatBatchDepth++;
+}
+
+FS::FATBatch::~FATBatch()
+{
+    // The outermost batch writes every change made during it, also when the operation failed half way. The operation
+    // already reports an error then. If the write fails too, the FAT blocks stay dirty and the next batch or sync()
+    // writes them again and reports it.
+    if (!m_isFlushed && --m_fs.m_fatBatchDepth == 0)
+    {
+        m_fs.UpdateFAT();
+    }
+}
+
+int FS::FATBatch::Flush()
+{
+    m_isFlushed = true;
+    return --m_fs.m_fatBatchDepth == 0 ? m_fs.UpdateFAT() : 0;
+}
+
+int FS::AddNewDirEntry(const int parentDirectoryBlock, const dir_entry &newDirEntry)
+{
+    if (!DirEntryExists(newDirEntry))
+    {
+        return ERROR_CODE;
+    } // Return if name is empty.
+
+    DirIndex *dirIndex = GetDirIndex(parentDirectoryBlock);
+    if (dirIndex == nullptr)
+    {
+        return ERROR_CODE;
+    }
+
+    DirSlot dirSlot;
+    if (!dirIndex->TakeFreeSlot(dirSlot))
+    {
+        // Every slot is taken, so the directory gets another block.
+        if (GrowDirectory(parentDirectoryBlock, *dirIndex) != 0 || !dirIndex->TakeFreeSlot(dirSlot))
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    if (!dirIndex->AddEntry(newDirEntry.file_name, dirSlot))
+    {
+        dirIndex->AddFreeSlot(dirSlot);
+        return ERROR_CODE;
+    }
+
+    if (WriteDirSlot(dirSlot, newDirEntry) != 0)
+    {
+        return ERROR_CODE;
+    }
+    m_dentryCache.Insert(parentDirectoryBlock, newDirEntry.file_name, {true, dirSlot, newDirEntry});
+    RememberParent(parentDirectoryBlock, newDirEntry);
+    return 0;
+}
+
+DirIndex *FS::GetDirIndex(const uint32_t dirBlock)
+{
+    auto found = m_dirIndexes.find(dirBlock);
+    if (found != m_dirIndexes.end())
+    {
+        return &found->second;
+    }
+
+    DirIndex dirIndex;
+    const int result = ForEachDirBlock(dirBlock, [this, &dirIndex](const uint32_t block, const dir_entry *dirEntries)
+    {
+        // Added backwards so the lowest free slot is handed out first.
+        for (uint32_t slot = DIR_BLOCK_SIZE; slot-- > 0;)
+        {
+            if (!DirEntryExists(dirEntries[slot]) || !dirIndex.AddEntry(dirEntries[slot].file_name, {block, slot}))
+            {
+                dirIndex.AddFreeSlot({block, slot});
+            }
+        }
+        return 0;
+    });
+    if (result != 0)
+    {
+        return nullptr;
+    }
+
+    if (m_dirIndexes.size() >= MAX_INDEXED_DIRS)
+    {
+        // Any directory will do, its index is built again the next time it is needed.
+        m_dirIndexes.erase(m_dirIndexes.begin());
+    }
+    return &(m_dirIndexes[dirBlock] = std::move(dirIndex));
+}
+
+int FS::GrowDirectory(const uint32_t dirBlock, DirIndex &dirIndex)
+{
+    FATBatch fatBatch(*this);
+
+    if (ExtendFileOnFAT(1, dirBlock) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    // The block may still hold data of a removed file, and a directory block has to start out without entries.
+    const uint32_t newBlock = GetEOFBlockFromStartBlock(dirBlock);
+    uint8_t emptyBlock[BLOCK_SIZE] = {0};
+    if (m_cache.Write(newBlock, emptyBlock) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    for (uint32_t slot = DIR_BLOCK_SIZE; slot-- > 0;)
+    {
+        dirIndex.AddFreeSlot({newBlock, slot});
+    }
+    return fatBatch.Flush();
+}
+
+int FS::WriteDirSlot(const DirSlot &slot, const dir_entry &dirEntry)
+{
+    dir_entry dirEntries[DIR_BLOCK_SIZE];
+    if (m_cache.Read(slot.block, (uint8_t *)dirEntries) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    dirEntries[slot.slot] = dirEntry;
+    return m_cache.Write(slot.block, (uint8_t *)dirEntries);
+}
+
+int FS::ForEachDirBlock(const uint32_t dirBlock, const DirBlockVisitor &dirBlockVisitor)
+{
+    // Directories are short, so the blocks are peeked one at a time instead of read ahead like file data.
+    for (int block = dirBlock; block != FAT_EOF; block = GetChildBlock(block))
+    {
+        const dir_entry *dirEntries = (const dir_entry *)m_cache.Peek(block);
+        if (dirEntries == nullptr)
+        {
+            return ERROR_CODE;
+        }
+
+        int result = dirBlockVisitor(block, dirEntries);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+int FS::AllocateNewFileOnFAT(const int nBlocksToAllocate, int *const allocatedFirstBlock)
+{
+    std::vector<int> freeBlocksArray;
+    if (GetFreeBlocks(nBlocksToAllocate, freeBlocksArray) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    // Go through the available blocks and insert correct flags and linkage.
+    for (int i = 0; i < nBlocksToAllocate; i++)
+    {
+        int freeBlockIndex = freeBlocksArray[i];
+        int32_t linkedBlock = i == nBlocksToAllocate - 1 ? FAT_EOF : freeBlocksArray[i + 1];
+
+        if (MakeFATEntry(freeBlockIndex, linkedBlock) != 0)
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    if (allocatedFirstBlock != nullptr)
+    {
+        *allocatedFirstBlock = freeBlocksArray[0];
+    }
+    return 0;
+}
+
+int FS::ExtendFileOnFAT(const int nBlocksToAllocate, const int startBlock)
+{
+    // The new blocks are added to the extents below instead of building them again from the FAT.
+    const int EOFBlock = GetEOFBlockFromStartBlock(startBlock);
+    ExtentList extents = GetChainExtents(startBlock);
+
+    // Try to continue right after the current end of the file so it stays in one extent.
+    std::vector<int> freeBlocksArray;
+    if (GetFreeBlocks(nBlocksToAllocate, freeBlocksArray, EOFBlock + 1) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    if (MakeFATEntry(EOFBlock, freeBlocksArray[0]) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    // Go through the available blocks and insert correct flags and linkage.
+    for (int i = 0; i < nBlocksToAllocate; i++)
+    {
+        int freeBlockIndex = freeBlocksArray[i];
+        int32_t linkedBlock = i == nBlocksToAllocate - 1 ? FAT_EOF : freeBlocksArray[i + 1];
+
+        if (MakeFATEntry(freeBlockIndex, linkedBlock) != 0)
+        {
+            return ERROR_CODE;
+        }
+        ExtentIndex::AppendBlock(extents, freeBlockIndex);
+    }
+
+    m_extentIndex.Insert(startBlock, std::move(extents));
+    return 0;
+}
+
+int FS::FreeChain(const int startBlock)
+{
+    // Freeing a block takes away its link to the next one, so the walk stops at the first block still linked from elsewhere.
+    int currentBlock = startBlock;
+    while (currentBlock != FAT_EOF && m_linkCounts[currentBlock] == 0)
+    {
+        int nextBlock = GetChildBlock(currentBlock);
+        if (FreeBlock(currentBlock) != 0)
+        {
+            return ERROR_CODE;
+        }
+        currentBlock = nextBlock;
+    }
+
+    return 0;
+}
+
+int FS::FreeBlock(const uint32_t block)
+{
+    if (MakeFATEntry(block, FAT_FREE) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    // The old data is no longer needed, so cached copies are dropped instead of written back.
+    m_cache.Drop(block, 1);
+    if (!m_needsZero[block])
+    {
+        m_needsZero[block] = true;
+        m_needsZeroCount++;
+    }
+    return 0;
+}
+
+int FS::ZeroFreedBlocks()
+{
+    uint32_t block = m_reservedBlocks;
+    while (m_needsZeroCount > 0 && block < m_blockCount)
+    {
+        if (!m_needsZero[block])
+        {
+            block++;
+            continue;
+        }
+
+        uint32_t runEnd = block;
+        while (runEnd < m_blockCount && m_needsZero[runEnd])
+        {
+            m_needsZero[runEnd] = false;
+            m_needsZeroCount--;
+            runEnd++;
+        }
+
+        // Disks backed by a file punch a hole, so even large runs cost one call.
+        if (m_cache.Discard(block, runEnd - block) != 0)
+        {
+            return ERROR_CODE;
+        }
+        block = runEnd;
+    }
+
+    return 0;
+}
+
+int FS::GetChildBlock(const int block)
+{
+    // Anything outside the file system ends the chain, so a damaged dir entry can not run off the FAT.
+    return block >= 0 && (uint32_t)block < m_blockCount ? m_fat[block] : FAT_EOF;
+}
+
+uint32_t FS::CalculateMinBlockCount(const uint64_t size)
+{
+    // Integer divison always results in a floor of the number if they are not already evenly divisable.
+    // This expression returns ceil of size / blocksize.
+    return (size % BLOCK_SIZE) ? size / BLOCK_SIZE + 1 : size / BLOCK_SIZE;
+}
+
+int FS::GetEOFBlockFromStartBlock(const int startBlock)
+{
+    const ExtentList &extents = GetChainExtents(startBlock);
+    if (extents.empty())
+    {
+        return FAT_EOF;
+    }
+    return extents.back().physicalBlock + extents.back().length - 1;
+}
+
+const ExtentList &FS::GetChainExtents(const int startBlock)
+{
+    const ExtentList *extents = m_extentIndex.Find(startBlock);
+    if (extents != nullptr)
+    {
+        return *extents;
+    }
+
+    ExtentList newExtents;
+    for (int block = startBlock; block != FAT_EOF; block = GetChildBlock(block))
+    {
+        ExtentIndex::AppendBlock(newExtents, block);
+    }
+    m_extentIndex.Insert(startBlock, std::move(newExtents));
+
+    return *m_extentIndex.Find(startBlock);
+}
+
+int FS::GetChainBlock(const int startBlock, const uint32_t logicalBlock)
+{
+    const int block = ExtentIndex::Lookup(GetChainExtents(startBlock), logicalBlock);
+    return block >= 0 ? block : FAT_EOF;
+}
+
+int FS::GetFirstSharedBlock(const int startBlock)
+{
+    // Without any shared block on the disk there is no chain to walk.
+    if (m_sharedBlockCount == 0)
+    {
+        return FAT_EOF;
+    }
+
+    // The first block of a file is never linked from another block, cp gives every copy its own.
+    uint32_t logicalBlock = 1;
+    for (int block = GetChildBlock(startBlock); block != FAT_EOF && logicalBlock < m_blockCount; block = GetChildBlock(block))
+    {
+        if (m_linkCounts[block] > 1)
+        {
+            return (int)logicalBlock;
+        }
+        logicalBlock++;
+    }
+    return FAT_EOF;
+}
+
+int FS::UnshareChain(const int startBlock, const uint32_t logicalBlock)
+{
+    const int firstSharedBlock = GetFirstSharedBlock(startBlock);
+    if (firstSharedBlock == FAT_EOF || (uint32_t)firstSharedBlock > logicalBlock)
+    {
+        return 0;
+    }
+
+    // The block before the shared ones is linked to the copies. Since it is the file's own, the other files keep theirs.
+    const int previousBlock = GetChainBlock(startBlock, firstSharedBlock - 1);
+    const int lastCopiedBlock = GetChainBlock(startBlock, logicalBlock);
+    if (previousBlock == FAT_EOF || lastCopiedBlock == FAT_EOF)
+    {
+        return ERROR_CODE;
+    }
+    const int sharedBlock = GetChildBlock(previousBlock);
+    const int restBlock = GetChildBlock(lastCopiedBlock);
+
+    const uint32_t copyCount = logicalBlock - firstSharedBlock + 1;
+    int copyFirstBlock;
+    if (AllocateNewFileOnFAT(copyCount, &copyFirstBlock) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    // The copies are written before anything links to them, so a failed copy leaves the file as it was.
+    {
+        ChainWriter copyWriter(*this, copyFirstBlock);
+        uint32_t copiedBlocks = 0;
+        int result = ForEachChainBlock(sharedBlock, [&](const uint8_t *sharedData)
+        {
+            uint8_t *copyData = copyWriter.NextBlock(false);
+            if (copyData == nullptr)
+            {
+                return ERROR_CODE;
+            }
+            memcpy(copyData, sharedData, BLOCK_SIZE);
+            return ++copiedBlocks == copyCount ? 1 : 0;
+        });
+        if (result < 0 || copiedBlocks < copyCount || copyWriter.Flush() != 0)
+        {
+            FreeChain(copyFirstBlock);
+            return ERROR_CODE;
+        }
+    }
+
+    // The copies continue where the shared blocks did, so the rest of the chain is shared with one more file.
+    if (MakeFATEntry(GetEOFBlockFromStartBlock(copyFirstBlock), restBlock) != 0 ||
+        MakeFATEntry(previousBlock, copyFirstBlock) != 0)
+    {
+        return ERROR_CODE;
+    }
+
+    ForgetCachedBlocks(startBlock);
+    return 0;
+}
+
+bool FS::BlockIsFree(const int block)
+{
+    return m_freeMap.IsFree(block);
+}
+
+bool FS::DirectoryIsEmpty(const dir_entry &dirEntry)
+{
+    const DirIndex *dirIndex = GetDirIndex(dirEntry.first_blk);
+    if (dirIndex == nullptr)
+    {
+        return false;
+    }
+
+    DirSlot backRefSlot;
+    const size_t backRefCount = dirIndex->Find("..", backRefSlot) ? 1 : 0;
+    return dirIndex->GetEntryCount() == backRefCount;
+}
+
+bool FS::DirEntryExists(const dir_entry &dirEntry)
+{
+    return dirEntry.file_name[0] != '\0';
+}
+
+int FS::GetFreeBlocks(int nBlocksToAdd, std::vector<int> &freeBlocksVector, const int hintBlock)
+{
+    // Fail early instead of scanning when the disk cannot fit the request.
+    if (nBlocksToAdd < 0 || nBlocksToAdd > (int)m_freeMap.GetFreeCount())
+    {
+        return ERROR_CODE;
+    }
+
+    freeBlocksVector.clear();
+    freeBlocksVector.reserve(nBlocksToAdd);
+    if (nBlocksToAdd == 0)
+    {
+        return 0;
+    }
+
+    // Contiguous run, either where the caller wants it or the smallest one that fits.
+    int runStart = -1;
+    if (hintBlock >= 0 && (int)m_freeMap.GetRunLength(hintBlock, nBlocksToAdd) == nBlocksToAdd)
+    {
+        runStart = hintBlock;
+    }
+    else
+    {
+        runStart = m_freeMap.FindBestFitRun(nBlocksToAdd);
+    }
+
+    if (runStart != -1)
+    {
+        for (int blockNum = runStart; blockNum < runStart + nBlocksToAdd; blockNum++)
+        {
+            freeBlocksVector.push_back(blockNum);
+        }
+        return 0;
+    }
+
+    // Fragmented fallback. Take whole runs in disk order starting at the roving cursor.
+    // Free blocks are visited in cyclic order and enough of them are free, so no block is taken twice.
+    int blockNum = m_freeMap.FindNextFree(m_allocCursor);
+    while (nBlocksToAdd > 0)
+    {
+        freeBlocksVector.push_back(blockNum);
+        nBlocksToAdd--;
+        blockNum = m_freeMap.FindNextFree(blockNum + 1);
+    }
+    m_allocCursor = freeBlocksVector.back() + 1;
+
+    return 0;
+}
+
+bool FS::FilenamesAreValid(const std::vector<std::string> &parsedFilePath)
+{
+    // An empty path has no elements and is invalid.
+    FS::PATH_TYPE pathType = EvaluatePathType(parsedFilePath);
+
+    if (pathType == PATH_TYPE::INVALID)
+    {
+        return false;
+    }
+    if (pathType == PATH_TYPE::ROOT)
+    {
+        return true;
+    }
+
+    for (size_t i = 0; i < parsedFilePath.size(); i++)
+    {
+        std::string filename = parsedFilePath[i];
+
+        if (HasSpecialCharacters(filename))
+        {
+            // Return error if the path is neither absolute and relative but has special characters.
+            if (pathType != PATH_TYPE::ABSOLUTE && pathType != PATH_TYPE::RELATIVE)
+            {
+                return false;
+            }
+
+            // Return not valid if the string contains special characters and is not the first in the path.
+            // i is equal to 0 for all cases below.
+            if (i != 0)
+            {
+                return false;
+            }
+
+            // Return not valid if the path is absolute and the first element is not empty.
+            if (pathType == PATH_TYPE::ABSOLUTE && filename != "")
+            {
+                return false;
+            }
+            // Return not valid if its relative and string is not ".".
+            if (pathType == PATH_TYPE::RELATIVE && !(filename == "."))
+            {
+                return false;
+            }
+        }
+
+        // Leave room for the null-terminator.
+        if (filename.size() >= FILE_NAME_SIZE)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FS::HasValidAccess(const dir_entry &dirEntry, const int accessBitMask)
+{
+    return (dirEntry.access_rights & accessBitMask) == accessBitMask ? true : false;
+}
+
+bool FS::HasSpecialCharacters(const std::string &filename)
+{
+    // Do not count ".." as special characters.
+    if (filename == "..")
+    {
+        return false;
+    }
+
+    for (const char character : filename)
+    {
+        if (!std::isalnum(character))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int FS::WriteDataStringToFile(std::string_view data, const dir_entry &fileDirEntry)
+{
+    // If dir entry is not file.
+    if (fileDirEntry.type != TYPE_FILE)
+    {
+        return ERROR_CODE;
+    }
+    // If file is too small to fit string data.
+    if (CalculateMinBlockCount(fileDirEntry.size) < CalculateMinBlockCount(data.size()))
+    {
+        return ERROR_CODE;
+    }
+
+    ChainWriter fileWriter(*this, fileDirEntry.first_blk);
+    size_t dataOffset = 0;
+    while (dataOffset < data.size()) // While there is still data to write.
+    {
+        uint8_t *blockBuffer = fileWriter.NextBlock(false);
+        if (blockBuffer == nullptr)
+        {
+            return ERROR_CODE;
+        }
+
+        // Only the end of the last block, which the data does not reach, has to be zeroed.
+        const size_t charactersToCopy = std::min<size_t>(data.size() - dataOffset, BLOCK_SIZE);
+        memcpy(blockBuffer, data.data() + dataOffset, charactersToCopy);
+        memset(blockBuffer + charactersToCopy, 0, BLOCK_SIZE - charactersToCopy);
+        dataOffset += charactersToCopy;
+    }
+
+    return fileWriter.Flush();
+}
+
+int FS::WriteFileToStream(const dir_entry &fileDirEntry, std::ostream &out)
+{
+    uint32_t bytesLeft = fileDirEntry.size;
+    if (bytesLeft == 0)
+    {
+        return 0;
+    }
+
+    const int result = ForEachChainBlock(fileDirEntry.first_blk, [&](const uint8_t *blockData)
+    {
+        const uint32_t blockBytes = std::min<uint32_t>(bytesLeft, BLOCK_SIZE);
+        out.write((const char *)blockData, blockBytes);
+        bytesLeft -= blockBytes;
+
+        // Stop once the size is reached instead of reading blocks past the end of the file.
+        return bytesLeft == 0 ? 1 : 0;
+    });
+
+    return result < 0 || !out ? ERROR_CODE : 0;
+}
+
+int FS::ForEachChainBlock(const int startBlock, const BlockVisitor &blockVisitor)
+{
+    // Blocks of a disk held in memory are used in place without any copy.
+    if (m_disk.map_block(startBlock) != nullptr)
+    {
+        for (int block = startBlock; block != FAT_EOF; block = GetChildBlock(block))
+        {
+            const uint8_t *blockData = m_cache.Peek(block);
+            if (blockData == nullptr)
+            {
+                return ERROR_CODE;
+            }
+
+            int result = blockVisitor(blockData);
+            if (result != 0)
+            {
+                return result;
+            }
+        }
+
+        return 0;
+    }
+
+    ChainReader reader(*this, startBlock);
+    for (const uint8_t *blockData = reader.NextBlock(); blockData != nullptr; blockData = reader.NextBlock())
+    {
+        int result = blockVisitor(blockData);
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    return reader.GetResult();
+}
+
+FS::ChainReader::ChainReader(FS &fs, const int startBlock, const unsigned window, const uint32_t blockCount)
+    : m_fs(fs), m_nextBlock(startBlock), m_window(window), m_blocksLeft(blockCount),
+      m_buffers{fs.TakeIOBuffer(), fs.TakeIOBuffer()}
+{
+    static_assert(READAHEAD_MAX_BLOCKS <= IO_BATCH_BLOCKS, "a readahead window has to fit in a batch buffer");
+    m_batches[0].reserve(READAHEAD_MAX_BLOCKS);
+    m_batches[1].reserve(READAHEAD_MAX_BLOCKS);
+
+    // Buffer 1 starts out as an empty current batch, so the first NextBlock() switches over to buffer 0.
+    Prefetch(0);
+}
+
+FS::ChainReader::~ChainReader()
+{
+    // The buffers must outlive every read that uses them.
+    m_fs.m_cache.WaitFor(m_pendingReads[0]);
+    m_fs.m_cache.WaitFor(m_pendingReads[1]);
+
+    m_fs.m_readaheadStats.unused += m_batches[m_currentBuffer].size() - m_position + m_batches[m_currentBuffer ^ 1].size();
+    m_fs.ReturnIOBuffer(std::move(m_buffers[0]));
+    m_fs.ReturnIOBuffer(std::move(m_buffers[1]));
+}
+
+const uint8_t *FS::ChainReader::NextBlock()
+{
+    if (m_result != 0)
+    {
+        return nullptr;
+    }
+
+    if (m_position == m_batches[m_currentBuffer].size())
+    {
+        // The current window is used up. Switch to the one read ahead and start reading the window after it.
+        m_batches[m_currentBuffer].clear();
+        m_currentBuffer ^= 1;
+        m_position = 0;
+        if (m_fs.m_cache.WaitFor(m_pendingReads[m_currentBuffer]) != 0)
+        {
+            m_result = ERROR_CODE;
+            return nullptr;
+        }
+        if (m_batches[m_currentBuffer].empty())
+        {
+            return nullptr;
+        }
+        if (Prefetch(m_currentBuffer ^ 1) != 0)
+        {
+            return nullptr;
+        }
+    }
+
+    return m_batches[m_currentBuffer][m_position++].buf;
+}
+
+int FS::ChainReader::Prefetch(const int buffer)
+{
+    std::vector<block_io> &batch = m_batches[buffer];
+    while (m_nextBlock != FAT_EOF && batch.size() < m_window && m_blocksLeft > 0)
+    {
+        batch.push_back({(unsigned)m_nextBlock, m_buffers[buffer].get() + batch.size() * BLOCK_SIZE});
+        m_nextBlock = m_fs.GetChildBlock(m_nextBlock);
+        m_blocksLeft--;
+    }
+    if (batch.empty())
+    {
+        return 0;
+    }
+
+    m_fs.m_readaheadStats.windows++;
+    m_fs.m_readaheadStats.blocks += batch.size();
+    // Every window is only requested once the one before it has been used to the end, so the walk is sequential.
+    m_window = m_window * 2 < READAHEAD_MAX_BLOCKS ? m_window * 2 : READAHEAD_MAX_BLOCKS;
+
+    if (m_fs.m_cache.ReadBlocks(batch, &m_pendingReads[buffer]) != 0)
+    {
+        m_result = ERROR_CODE;
+    }
+    return m_result;
+}
+
+FS::ChainWriter::ChainWriter(FS &fs, const int startBlock)
+    : m_fs(fs), m_nextBlock(startBlock), m_buffers{fs.TakeIOBuffer(), fs.TakeIOBuffer()}
+{
+    m_batch.reserve(IO_BATCH_BLOCKS);
+}
+
+FS::ChainWriter::~ChainWriter()
+{
+    // The buffers must outlive every write that uses them.
+    m_fs.m_cache.WaitFor(m_pendingWrites[0]);
+    m_fs.m_cache.WaitFor(m_pendingWrites[1]);
+    m_fs.ReturnIOBuffer(std::move(m_buffers[0]));
+    m_fs.ReturnIOBuffer(std::move(m_buffers[1]));
+}
+
+uint8_t *FS::ChainWriter::NextBlock(const bool zeroFill)
+{
+    if (m_nextBlock == FAT_EOF)
+    {
+        return nullptr;
+    }
+    if (m_batch.size() == IO_BATCH_BLOCKS && SubmitBatch() != 0)
+    {
+        return nullptr;
+    }
+
+    uint8_t *blockBuffer = m_buffers[m_currentBuffer].get() + m_batch.size() * BLOCK_SIZE;
+    if (zeroFill)
+    {
+        memset(blockBuffer, 0, BLOCK_SIZE);
+    }
+    m_batch.push_back({(unsigned)m_nextBlock, blockBuffer});
+    m_nextBlock = m_fs.GetChildBlock(m_nextBlock);
+
+    return blockBuffer;
+}
+
+int FS::ChainWriter::SubmitBatch()
+{
+    if (!m_batch.empty() && m_fs.m_cache.WriteBlocks(m_batch, &m_pendingWrites[m_currentBuffer]) != 0)
+    {
+        m_result = ERROR_CODE;
+    }
+    m_batch.clear();
+
+    // Writes of the other buffer were submitted one batch ago and have had the time since to finish.
+    m_currentBuffer ^= 1;
+    if (m_fs.m_cache.WaitFor(m_pendingWrites[m_currentBuffer]) != 0)
+    {
+        m_result = ERROR_CODE;
+    }
+
+    return m_result;
+}
+
+int FS::ChainWriter::Flush()
+{
+    SubmitBatch();
+    if (m_fs.m_cache.WaitFor(m_pendingWrites[m_currentBuffer ^ 1]) != 0)
+    {
+        m_result = ERROR_CODE;
+    }
+
+    return m_result;
+}
+
+void FS::IOBufferDeleter::operator()(uint8_t *buffer) const
+{
+    operator delete[](buffer, std::align_val_t(BLOCK_SIZE));
+}
+
+FS::IOBuffer FS::TakeIOBuffer()
+{
+    if (m_freeIOBuffers.empty())
+    {
+        // Not zeroed, every block of a batch is either filled before it is written or read into before it is used.
+        return IOBuffer(new (std::align_val_t(BLOCK_SIZE)) uint8_t[IO_BATCH_BLOCKS * BLOCK_SIZE]);
+    }
+
+    IOBuffer buffer = std::move(m_freeIOBuffers.back());
+    m_freeIOBuffers.pop_back();
+    return buffer;
+}
+
+void FS::ReturnIOBuffer(IOBuffer buffer)
+{
+    if (m_freeIOBuffers.size() < MAX_FREE_IO_BUFFERS)
+    {
+        m_freeIOBuffers.push_back(std::move(buffer));
+    }
+}
+
+const FS::DentryCache::Dentry *FS::DentryCache::Find(const uint32_t dirBlock, const std::string &name)
+{
+    auto dir = m_dirs.find(dirBlock);
+    if (dir != m_dirs.end())
+    {
+        auto found = dir->second.find(name);
+        if (found != dir->second.end())
+        {
+            m_stats.hits++;
+            m_stats.negativeHits += found->second.exists ? 0 : 1;
+            return &found->second;
+        }
+    }
+
+    m_stats.misses++;
+    return nullptr;
+}
+
+void FS::DentryCache::Insert(const uint32_t dirBlock, const std::string &name, const Dentry &dentry)
+{
+    auto dir = m_dirs.find(dirBlock);
+    if (dir != m_dirs.end())
+    {
+        auto found = dir->second.find(name);
+        if (found != dir->second.end())
+        {
+            found->second = dentry;
+            return;
+        }
+    }
+
+    if (m_size >= MAX_CACHED_DENTRIES)
+    {
+        // Any directory will do, its names are looked up again the next time they are needed.
+        m_stats.evictions += m_dirs.begin()->second.size();
+        InvalidateDirectory(m_dirs.begin()->first);
+    }
+
+    m_dirs[dirBlock][name] = dentry;
+    m_size++;
+}
+
+void FS::DentryCache::InvalidateDirectory(const uint32_t dirBlock)
+{
+    auto dir = m_dirs.find(dirBlock);
+    if (dir == m_dirs.end())
+    {
+        return;
+    }
+
+    m_size -= dir->second.size();
+    m_dirs.erase(dir);
+}
+
+void FS::DentryCache::Clear()
+{
+    m_dirs.clear();
+    m_size = 0;
+}
+
+int FS::CollectEntries(const uint32_t dirBlock, std::vector<ResolvedPath> &entriesOut)
+{
+    std::vector<bool> visited(m_blockCount, false);
+    std::vector<uint32_t> dirBlocks = {dirBlock};
+    while (!dirBlocks.empty())
+    {
+        const uint32_t currentDirBlock = dirBlocks.back();
+        dirBlocks.pop_back();
+        if (currentDirBlock >= m_blockCount || visited[currentDirBlock])
+        {
+            continue;
+        }
+        visited[currentDirBlock] = true;
+
+        const int result = ForEachDirBlock(currentDirBlock, [&](const uint32_t block, const dir_entry *dirEntries)
+        {
+            for (uint32_t slot = 0; slot < DIR_BLOCK_SIZE; slot++)
+            {
+                const dir_entry &dirEntry = dirEntries[slot];
+                if (!DirEntryExists(dirEntry) || strcmp(dirEntry.file_name, "..") == 0)
+                {
+                    continue;
+                }
+
+                entriesOut.push_back({currentDirBlock, dirEntry.file_name, true, {block, slot}, dirEntry});
+                if (dirEntry.type == TYPE_DIR)
+                {
+                    dirBlocks.push_back(dirEntry.first_blk);
+                }
+            }
+            return 0;
+        });
+        if (result != 0)
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    return 0;
+}
+
+void FS::FsckWorker(FsckState &state)
+{
+    std::unique_lock<std::mutex> lock(state.mutex);
+    while (true)
+    {
+        // Once no directory is waiting and no worker can add more, the walk is done.
+        state.workAvailable.wait(lock, [&state] { return !state.pendingDirs.empty() || state.busyWorkers == 0; });
+        if (state.pendingDirs.empty())
+        {
+            break;
+        }
+
+        const std::pair<uint32_t, uint32_t> dir = state.pendingDirs.back();
+        state.pendingDirs.pop_back();
+        state.busyWorkers++;
+
+        lock.unlock();
+        FsckDirectory(state, dir.first, dir.second);
+        lock.lock();
+
+        state.busyWorkers--;
+    }
+
+    state.workAvailable.notify_all();
+}
+
+void FS::FsckDirectory(FsckState &state, const uint32_t dirBlock, const uint32_t parentDirBlock)
+{
+    state.directories++;
+
+    std::vector<FsckEntry> entries;
+    std::vector<uint32_t> subDirBlocks;
+    // pwd finds the parent of a directory through its ".." entry, so it has to point at the directory it was found in.
+    bool parentRefIsValid = dirBlock == ROOT_BLOCK;
+    // The chain was claimed before the directory was queued. A broken chain is only followed as far as it is valid.
+    uint32_t block = dirBlock;
+    for (uint32_t blockCount = 0; blockCount < m_blockCount; blockCount++)
+    {
+        dir_entry dirEntries[DIR_BLOCK_SIZE];
+        if (m_disk.read(block, (uint8_t *)dirEntries) != 0)
+        {
+            state.readFailed = true;
+            return;
+        }
+
+        FsckDirectoryBlock(state, block, dirEntries, parentDirBlock, entries, subDirBlocks, parentRefIsValid);
+
+        const int32_t nextBlock = m_fat[block];
+        if (nextBlock == FAT_EOF || nextBlock < (int32_t)m_reservedBlocks || (uint32_t)nextBlock >= m_blockCount ||
+            m_fat[nextBlock] == FAT_FREE)
+        {
+            break;
+        }
+        block = nextBlock;
+    }
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.entries.insert(state.entries.end(), entries.begin(), entries.end());
+    if (!parentRefIsValid)
+    {
+        state.badParentRefs.push_back({dirBlock, parentDirBlock});
+    }
+    for (const uint32_t subDirBlock : subDirBlocks)
+    {
+        state.pendingDirs.push_back({subDirBlock, dirBlock});
+    }
+    state.workAvailable.notify_all();
+}
+
+void FS::FsckDirectoryBlock(FsckState &state, const uint32_t block, const dir_entry *dirEntries, const uint32_t parentDirBlock,
+                            std::vector<FsckEntry> &entriesOut, std::vector<uint32_t> &subDirBlocksOut, bool &parentRefIsValid)
+{
+    for (uint32_t slot = 0; slot < DIR_BLOCK_SIZE; slot++)
+    {
+        const dir_entry &dirEntry = dirEntries[slot];
+        if (!DirEntryExists(dirEntry))
+        {
+            continue;
+        }
+        if (strcmp(dirEntry.file_name, "..") == 0)
+        {
+            parentRefIsValid = parentRefIsValid || dirEntry.first_blk == parentDirBlock;
+            continue;
+        }
+
+        const uint32_t id = block * DIR_BLOCK_SIZE + slot + FSCK_ROOT_ID + 1;
+        entriesOut.push_back({id, block, dirEntry});
+        if (dirEntry.type != TYPE_FILE && dirEntry.type != TYPE_DIR)
+        {
+            state.badEntries++;
+            continue;
+        }
+
+        // A file keeps its first block also when it is empty.
+        const uint32_t fileBlockCount = std::max<uint32_t>(1, CalculateMinBlockCount(dirEntry.size));
+        uint32_t blockCount;
+        const bool chainIsValid =
+            FsckClaimChain(state, id, dirEntry.first_blk, dirEntry.type == TYPE_FILE, fileBlockCount, blockCount);
+        if (!chainIsValid)
+        {
+            state.badChains++;
+        }
+
+        if (dirEntry.type == TYPE_FILE)
+        {
+            state.files++;
+            if (blockCount != fileBlockCount)
+            {
+                state.sizeMismatches++;
+            }
+        }
+        else if (chainIsValid && !state.visitedDirs[dirEntry.first_blk].exchange(true))
+        {
+            subDirBlocksOut.push_back(dirEntry.first_blk);
+        }
+    }
+}
+
+bool FS::FsckClaimChain(FsckState &state, const uint32_t id, const uint32_t firstBlock, const bool isFileChain,
+                        const uint32_t fileBlockCount, uint32_t &blockCountOut)
+{
+    auto markCrossLinked = [&state](const uint32_t crossLinkedBlock)
+    {
+        if (!state.crossLinked[crossLinkedBlock].exchange(true))
+        {
+            state.crossLinkedBlocks++;
+        }
+    };
+
+    blockCountOut = 0;
+    uint32_t block = firstBlock;
+    // Set once the chain has reached the blocks it shares with copies of the file.
+    bool isShared = false;
+    int32_t firstSharedBlock = FAT_EOF;
+    while (true)
+    {
+        if (block < m_reservedBlocks || block >= m_blockCount || m_fat[block] == FAT_FREE || blockCountOut >= m_blockCount)
+        {
+            return false;
+        }
+
+        // The first block of an entry is not linked from any block, except the first block of the root's chain, which is
+        // linked from ROOT_BLOCK. Every other block is linked from the block before it, and in files also from copies.
+        isShared = isShared || (isFileChain && blockCountOut > 0 && m_linkCounts[block] > 1);
+        const uint32_t allowedLinks = blockCountOut > 0 || id == FSCK_ROOT_ID ? 1 : 0;
+        const bool hasOtherLinks = !isShared && m_linkCounts[block] > allowedLinks;
+
+        // The entry with the lowest id keeps a block that several entries claim, so repairs do not depend on thread timing.
+        uint32_t owner = state.owners[block].load();
+        while ((owner == 0 || owner > id) && !state.owners[block].compare_exchange_weak(owner, id))
+        {
+        }
+        if (owner == id)
+        {
+            return false;
+        }
+
+        if (owner == 0)
+        {
+            state.usedBlocks++;
+        }
+        if ((owner != 0 && !isShared) || hasOtherLinks)
+        {
+            markCrossLinked(block);
+        }
+        else if (owner != 0)
+        {
+            state.shared[block] = true;
+        }
+
+        // Copies keep every shared block at the position it had in the file they were copied from. A chain reaching
+        // the block at another position was linked into it.
+        if (isShared)
+        {
+            firstSharedBlock = firstSharedBlock == FAT_EOF ? (int32_t)block : firstSharedBlock;
+            uint32_t position = 0;
+            if (!state.sharedPositions[block].compare_exchange_strong(position, blockCountOut + 1) &&
+                position != blockCountOut + 1)
+            {
+                markCrossLinked(block);
+            }
+        }
+
+        blockCountOut++;
+        if (m_fat[block] == FAT_EOF)
+        {
+            // Copies also have as many blocks as their size needs. If this file has more or fewer, the blocks it shares
+            // may belong to a file it was linked into, so none of them count as shared.
+            if (firstSharedBlock != FAT_EOF && blockCountOut != fileBlockCount)
+            {
+                for (int32_t sharedBlock = firstSharedBlock; sharedBlock != FAT_EOF; sharedBlock = m_fat[sharedBlock])
+                {
+                    markCrossLinked(sharedBlock);
+                }
+            }
+            return true;
+        }
+        block = m_fat[block];
+    }
+}
+
+int FS::FsckRepair(FsckState &state)
+{
+    FATBatch fatBatch(*this);
+
+    // Replaces the entry in one slot of a directory block.
+    auto writeSlot = [this](const uint32_t dirBlock, const uint32_t slot, const dir_entry &newDirEntry)
+    {
+        dir_entry dirEntries[DIR_BLOCK_SIZE];
+        if (m_cache.Read(dirBlock, (uint8_t *)dirEntries) != 0)
+        {
+            return ERROR_CODE;
+        }
+        dirEntries[slot] = newDirEntry;
+        return m_cache.Write(dirBlock, (uint8_t *)dirEntries);
+    };
+
+    // Walks the chain from block on, keeping at most maxBlockCount blocks for id, as long as no other entry kept them or
+    // they are shared with other files. previousBlock ends up at the last block kept, and block at the first one that
+    // is not, or FAT_EOF if the whole chain is kept.
+    auto keepOwnedBlocks = [this, &state](const uint32_t id, const uint32_t maxBlockCount, int &previousBlock, int &block)
+    {
+        uint32_t blockCount = 0;
+        while (block != FAT_EOF && blockCount < maxBlockCount && (uint32_t)block >= m_reservedBlocks &&
+               (uint32_t)block < m_blockCount && m_fat[block] != FAT_FREE)
+        {
+            const uint32_t owner = state.owners[block];
+            const bool isKept = (owner & FSCK_KEPT_FLAG) != 0;
+            const bool isShared = state.shared[block] && !state.crossLinked[block];
+            if (isShared && isKept && owner != (id | FSCK_KEPT_FLAG))
+            {
+                // The rest of the chain was kept for another file sharing it and ends where that file's chain ends.
+                for (; block != FAT_EOF; block = GetChildBlock(block))
+                {
+                    blockCount++;
+                }
+                break;
+            }
+            // Entries are repaired in id order, so a block is kept by its owner, the claimant with the lowest id, unless
+            // the owner's chain was cut before it. Then the next entry reaching it keeps it.
+            if (isKept)
+            {
+                break;
+            }
+
+            // Kept blocks are marked so a chain that runs into itself stops the second time round.
+            state.owners[block] = id | FSCK_KEPT_FLAG;
+            previousBlock = block;
+            block = m_fat[block];
+            blockCount++;
+        }
+        return blockCount;
+    };
+
+    {
+        int previousBlock = ROOT_BLOCK;
+        int block = m_fat[ROOT_BLOCK];
+        keepOwnedBlocks(FSCK_ROOT_ID, UINT32_MAX, previousBlock, block);
+        if (block != FAT_EOF && MakeFATEntry(previousBlock, FAT_EOF) != 0)
+        {
+            return ERROR_CODE;
+        }
+    }
+
+    // Same order on every run, whatever order the workers found the entries in.
+    std::sort(state.entries.begin(), state.entries.end(), [](const FsckEntry &a, const FsckEntry &b) { return a.id < b.id; });
+
+    // Every chain is cut before the first block another entry kept, and every file after the blocks its size needs.
+    // Entries left without any block are removed.
+    for (const FsckEntry &found : state.entries)
     {
-        int freeBlockIndex = freeBlocksArray[i];
-        int16_t linkedBlock = i == nBlocksToAllocate - 1 ? FAT_EOF : freeBlocksArray[i + 1];
+        dir_entry repairedEntry = found.entry;
+        const bool typeIsValid = found.entry.type == TYPE_FILE || found.entry.type == TYPE_DIR;
 
-        if (MakeFATEntry(freeBlockIndex, linkedBlock) != 0)
+        int previousBlock = FAT_EOF;
+        int block = typeIsValid ? (int)found.entry.first_blk : FAT_EOF;
+        const uint32_t maxBlockCount =
+            found.entry.type == TYPE_FILE ? std::max<uint32_t>(1, CalculateMinBlockCount(found.entry.size)) : UINT32_MAX;
+        const uint32_t blockCount = keepOwnedBlocks(found.id, maxBlockCount, previousBlock, block);
+
+        const uint32_t slot = (found.id - FSCK_ROOT_ID - 1) % DIR_BLOCK_SIZE;
+        if (previousBlock == FAT_EOF)
+        {
+            if (writeSlot(found.dirBlock, slot, dir_entry{}) != 0)
+            {
+                return ERROR_CODE;
+            }
+            continue;
+        }
+        if (block != FAT_EOF && MakeFATEntry(previousBlock, FAT_EOF) != 0)
         {
             return ERROR_CODE;
         }
-    }
 
-    if (allocatedFirstBlock != nullptr)
-    {
-        *allocatedFirstBlock = freeBlocksArray[0];
+        if (found.entry.type == TYPE_FILE && CalculateMinBlockCount(found.entry.size) > blockCount)
+        {
+            repairedEntry.size = blockCount * BLOCK_SIZE;
+            if (writeSlot(found.dirBlock, slot, repairedEntry) != 0)
+            {
+                return ERROR_CODE;
+            }
+        }
     }
-    return 0;
-}
 
-int FS::ExtendFileOnFAT(const int nBlocksToAllocate, const int startBlock)
-{
-    std::vector<int> freeBlocksArray;
-    if (GetFreeBlocks(nBlocksToAllocate, freeBlocksArray) != 0)
+    for (const std::pair<uint32_t, uint32_t> &badParentRef : state.badParentRefs)
     {
-        return ERROR_CODE;
-    }
+        dir_entry dirEntries[DIR_BLOCK_SIZE];
+        if (m_cache.Read(badParentRef.first, (uint8_t *)dirEntries) != 0)
+        {
+            return ERROR_CODE;
+        }
 
-    // Update EOF block.
-    int EOFBlock = GetEOFBlockFromStartBlock(startBlock);
-    if (MakeFATEntry(EOFBlock, freeBlocksArray[0]) != 0)
-    {
-        return ERROR_CODE;
+        // Fix the existing ".." entry, or add one in the first free slot.
+        int parentRefSlot = -1;
+        for (uint32_t slot = 0; slot < DIR_BLOCK_SIZE && parentRefSlot == -1; slot++)
+        {
+            if (strcmp(dirEntries[slot].file_name, "..") == 0)
+            {
+                parentRefSlot = slot;
+            }
+        }
+        for (uint32_t slot = 0; slot < DIR_BLOCK_SIZE && parentRefSlot == -1; slot++)
+        {
+            if (!DirEntryExists(dirEntries[slot]))
+            {
+                parentRefSlot = slot;
+            }
+        }
+        if (parentRefSlot == -1)
+        {
+            continue;
+        }
+
+        dir_entry backRefDirEntry = {};
+        strcpy(backRefDirEntry.file_name, "..");
+        backRefDirEntry.first_blk = badParentRef.second;
+        backRefDirEntry.type = TYPE_DIR;
+        if (writeSlot(badParentRef.first, parentRefSlot, backRefDirEntry) != 0)
+        {
+            return ERROR_CODE;
+        }
     }
 
-    // Go through the available blocks and insert correct flags and linkage.
-    for (int i = 0; i < nBlocksToAllocate; i++)
+    // Only the blocks kept above are still linked from an entry. Blocks past a cut keep the owner that claimed them
+    // during the check, so a used block counts as leaked unless it was kept, not only when nothing claimed it.
+    for (uint32_t block = m_reservedBlocks; block < m_blockCount; block++)
     {
-        int freeBlockIndex = freeBlocksArray[i];
-        int16_t linkedBlock = i == nBlocksToAllocate - 1 ? FAT_EOF : freeBlocksArray[i + 1];
-
-        if (MakeFATEntry(freeBlockIndex, linkedBlock) != 0)
+        if (m_fat[block] != FAT_FREE && (state.owners[block] & FSCK_KEPT_FLAG) == 0 && FreeBlock(block) != 0)
         {
             return ERROR_CODE;
         }
     }
 
-    return 0;
-}
-
-int FS::GetChildBlock(const int block)
-{
-    return m_fat[block];
-}
-
-int FS::CalculateMinBlockCount(const int size)
-{
-    // Integer divison always results in a floor of the number if they are not already evenly divisable.
-    // This expression returns ceil of size / blocksize.
-    return (size % BLOCK_SIZE) ? size / BLOCK_SIZE + 1 : size / BLOCK_SIZE;
+    // Entries were changed behind the name indexes and the dentry cache, and shared chains were cut behind the extent index.
+    m_extentIndex.Clear();
+    m_dirIndexes.clear();
+    m_dentryCache.Clear();
+    m_dirParents.clear();
+    return fatBatch.Flush();
 }
 
-int FS::GetEOFBlockFromStartBlock(const int startBlock)
+FS::OpenFile *FS::GetOpenFile(const int fd)
 {
-    int EOFBlock = startBlock;
-    while (GetChildBlock(EOFBlock) != FAT_EOF)
+    if (fd < 0 || (size_t)fd >= m_openFiles.size() || !m_openFiles[fd].isOpen)
     {
-        EOFBlock = GetChildBlock(EOFBlock);
+        return nullptr;
     }
-
-    return EOFBlock;
-}
-
-bool FS::BlockIsFree(const int block)
-{
-    return m_fat[block] == FAT_FREE;
+    return &m_openFiles[fd];
 }
 
-bool FS::DirectoryIsEmpty(const dir_entry &dirEntry)
+int FS::GetOpenFileEntry(const OpenFile &file, ResolvedPath &entryOut)
 {
-    dir_entry dirEntries[DIR_BLOCK_SIZE];
-    if (m_disk.read(dirEntry.first_blk, (uint8_t *)dirEntries) != 0)
+    const dir_entry *dirEntries = (const dir_entry *)m_cache.Peek(file.slot.block);
+    if (dirEntries == nullptr)
     {
-        return false;
+        return ERROR_CODE;
     }
 
-    for (int i = 1; i < DIR_BLOCK_SIZE; i++) // Skip back ref dir ".."
+    // The entry may have been renamed in its slot, but never moved out of it while the file is open.
+    const dir_entry &dirEntry = dirEntries[file.slot.slot];
+    if (!DirEntryExists(dirEntry) || dirEntry.first_blk != file.firstBlock)
     {
-        if (DirEntryExists(dirEntries[i]))
-        {
-            return false;
-        }
+        return ERROR_CODE;
     }
 
-    return true;
-}
-
-bool FS::FilepathExists(const std::string &filePath)
-{
-    dir_entry dirEntry;
-    GetDirEntry(ParseDirPath(filePath), dirEntry);
-
-    return DirEntryExists(dirEntry);
-}
-
-bool FS::DirEntryExists(const dir_entry &dirEntry)
-{
-    return dirEntry.file_name[0] != '\0';
+    entryOut = {file.dirBlock, dirEntry.file_name, true, file.slot, dirEntry};
+    return 0;
 }
 
-int FS::GetFreeBlocks(int nBlocksToAdd, std::vector<int> &freeBlocksVector)
+bool FS::FileIsOpen(const uint32_t firstBlock)
 {
-    if (nBlocksToAdd < 0)
-    {
-        return ERROR_CODE;
-    }
-
-    freeBlocksVector.clear();
-    for (int blockNum = 0; blockNum < FAT_SIZE; blockNum++) // Find free blocks.
+    for (const OpenFile &openFile : m_openFiles)
     {
-        if (nBlocksToAdd == 0)
+        if (openFile.isOpen && openFile.firstBlock == firstBlock)
         {
-            break;
+            return true;
         }
+    }
+    return false;
+}
 
-        if (BlockIsFree(blockNum))
+void FS::ForgetCachedBlocks(const uint32_t firstBlock)
+{
+    for (OpenFile &openFile : m_openFiles)
+    {
+        if (openFile.isOpen && openFile.firstBlock == firstBlock)
         {
-            freeBlocksVector.push_back(blockNum);
-            nBlocksToAdd--;
+            openFile.cachedBlock = FAT_EOF;
         }
     }
-
-    return 0;
 }
 
-bool FS::FilenamesAreValid(std::string &dirpath)
+size_t FS::OpenFileCount()
 {
-    if (dirpath.empty())
+    size_t openFileCount = 0;
+    for (const OpenFile &openFile : m_openFiles)
     {
-        return false;
+        openFileCount += openFile.isOpen ? 1 : 0;
     }
+    return openFileCount;
+}
 
-    std::vector<std::string> parsedFilePath = ParseDirPath(dirpath);
-    FS::PATH_TYPE pathType = EvaluatePathType(parsedFilePath);
-
-    if (pathType == PATH_TYPE::INVALID)
+int FS::GetFileBlock(OpenFile &file, const uint32_t logicalBlock)
+{
+    int block;
+    if (file.cachedBlock != FAT_EOF && logicalBlock == file.cachedLogicalBlock)
     {
-        return false;
+        block = file.cachedBlock;
     }
-    if (pathType == PATH_TYPE::ROOT)
+    else if (file.cachedBlock != FAT_EOF && logicalBlock == file.cachedLogicalBlock + 1)
     {
-        return true;
+        block = GetChildBlock(file.cachedBlock);
     }
-
-    for (int i = 0; i < parsedFilePath.size(); i++)
+    else
     {
-        std::string filename = parsedFilePath[i];
-
-        if (HasSpecialCharacters(filename))
-        {
-            // Return error if the path is neither absolute and relative but has special characters.
-            if (pathType != PATH_TYPE::ABSOLUTE && pathType != PATH_TYPE::RELATIVE)
-            {
-                return false;
-            }
-
-            // Return not valid if the string contains special characters and is not the first in the path.
-            // i is equal to 0 for all cases below.
-            if (i != 0)
-            {
-                return false;
-            }
-
-            // Return not valid if the path is absolute and the first element is not empty.
-            if (pathType == PATH_TYPE::ABSOLUTE && filename != "")
-            {
-                return false;
-            }
-            // Return not valid if its relative and string is not ".".
-            if (pathType == PATH_TYPE::RELATIVE && !(filename == "."))
-            {
-                return false;
-            }
-        }
-
-        if (filename.size() > FILE_NAME_SIZE)
-        {
-            return false;
-        }
+        block = GetChainBlock(file.firstBlock, logicalBlock);
     }
 
-    return true;
-}
-
-bool FS::HasValidAccess(const dir_entry &dirEntry, const int accessBitMask)
-{
-    return (dirEntry.access_rights & accessBitMask) == accessBitMask ? true : false;
+    if (block != FAT_EOF)
+    {
+        file.cachedLogicalBlock = logicalBlock;
+        file.cachedBlock = block;
+    }
+    return block;
 }
 
-bool FS::HasSpecialCharacters(const std::string &filename)
+int FS::UnshareFileBlocks(OpenFile &file, const uint32_t logicalBlock)
 {
-    // Do not count ".." as special characters.
-    if (filename == "..")
+    // Blocks only become shared through a change of m_shareGeneration, and the file's own changes never share any.
+    if (file.shareGeneration == m_shareGeneration && logicalBlock < file.unsharedBlocks)
     {
-        return false;
+        return 0;
     }
-
-    for (const char character : filename)
+    if (UnshareChain(file.firstBlock, logicalBlock) != 0)
     {
-        if (!std::isalnum(character))
-        {
-            return true;
-        }
+        return ERROR_CODE;
     }
 
-    return false;
+    // Blocks added to the end of an unshared chain are not shared either.
+    const int firstSharedBlock = GetFirstSharedBlock(file.firstBlock);
+    file.unsharedBlocks = firstSharedBlock == FAT_EOF ? UINT32_MAX : (uint32_t)firstSharedBlock;
+    file.shareGeneration = m_shareGeneration;
+    return 0;
 }
 
-int FS::WriteDataStringToFile(std::string stringData, const dir_entry &fileDirEntry)
+int FS::WriteFileRange(OpenFile &file, const ResolvedPath &entry, const uint8_t *data, const uint32_t offset,
+                       const uint32_t count, const uint32_t newSize)
 {
-    // If dir entry is not file.
-    if (fileDirEntry.type != TYPE_FILE)
+    FATBatch fatBatch(*this);
+
+    const uint32_t chainBlockCount = ExtentIndex::GetBlockCount(GetChainExtents(file.firstBlock));
+    const uint32_t newBlockCount = CalculateMinBlockCount(newSize);
+
+    // Blocks up to the old size hold data. Blocks after it, also ones before offset, are written from zero.
+    const uint32_t dataBlockCount = CalculateMinBlockCount(entry.entry.size);
+    const uint32_t rangeStart = count > 0 && offset / BLOCK_SIZE < dataBlockCount ? offset / BLOCK_SIZE : dataBlockCount;
+    const uint32_t rangeEnd = std::max<uint32_t>(count > 0 ? CalculateMinBlockCount((uint64_t)offset + count) : 0,
+                                                 newBlockCount > dataBlockCount ? newBlockCount : 0);
+
+    // Written blocks, and the last block if new ones are linked to it, must not be shared with a copy of the file.
+    const bool growsChain = newBlockCount > chainBlockCount;
+    if ((growsChain || rangeStart < rangeEnd) && UnshareFileBlocks(file, growsChain ? chainBlockCount - 1 : rangeEnd - 1) != 0)
     {
         return ERROR_CODE;
     }
-    // If file is too small to fit string data.
-    if (CalculateMinBlockCount(fileDirEntry.size) < CalculateMinBlockCount(stringData.size()))
+    if (growsChain && ExtendFileOnFAT(newBlockCount - chainBlockCount, file.firstBlock) != 0)
     {
         return ERROR_CODE;
     }
 
-    int nextBlock = fileDirEntry.first_blk;
-    while (!stringData.empty()) // While there is still data to write.
+    // Fills a zeroed block of the range. Data blocks that are only partly overwritten keep the rest of their data.
+    auto fillBlock = [&](const uint32_t logicalBlock, const int block, uint8_t *blockData)
     {
-        char blockBuffer[BLOCK_SIZE] = {'\0'};
-        int fileContentSize = stringData.size();
-        int charactersToCopy = BLOCK_SIZE < fileContentSize ? BLOCK_SIZE : fileContentSize % BLOCK_SIZE;
-        memcpy(blockBuffer, stringData.c_str(), charactersToCopy);
-        if (m_disk.write(nextBlock, (uint8_t *)blockBuffer) != 0)
+        const uint64_t blockStart = (uint64_t)logicalBlock * BLOCK_SIZE;
+        const uint64_t copyStart = std::max<uint64_t>(offset, blockStart);
+        const uint64_t copyEnd = std::min<uint64_t>((uint64_t)offset + count, blockStart + BLOCK_SIZE);
+        const uint32_t bytesToCopy = copyEnd > copyStart ? copyEnd - copyStart : 0;
+
+        if (logicalBlock < dataBlockCount && bytesToCopy < BLOCK_SIZE && m_cache.Read(block, blockData) != 0)
         {
             return ERROR_CODE;
         }
+        if (bytesToCopy > 0)
+        {
+            memcpy(blockData + (copyStart - blockStart), data + (copyStart - offset), bytesToCopy);
+        }
+        return 0;
+    };
 
-        stringData.erase(0, charactersToCopy);
-        nextBlock = GetChildBlock(nextBlock);
+    if (rangeEnd - rangeStart <= CACHED_IO_MAX_BLOCKS)
+    {
+        for (uint32_t logicalBlock = rangeStart; logicalBlock < rangeEnd; logicalBlock++)
+        {
+            const int block = GetFileBlock(file, logicalBlock);
+            uint8_t blockData[BLOCK_SIZE] = {0};
+            if (block == FAT_EOF || fillBlock(logicalBlock, block, blockData) != 0 || m_cache.Write(block, blockData) != 0)
+            {
+                return ERROR_CODE;
+            }
+        }
     }
-
-    return 0;
-}
-
-int FS::ReadFileToDataString(std::string &stringData, const dir_entry &fileDirEntry)
-{
-    char blockBuffer[BLOCK_SIZE] = {'\0'};
-    int currentBlock = fileDirEntry.first_blk;
-    // Read all data from dest file into memory.
-    while (currentBlock != FAT_EOF)
+    else if (rangeStart < rangeEnd)
     {
-        if (m_disk.read(currentBlock, (uint8_t *)blockBuffer) != 0)
+        ChainWriter writer(*this, GetFileBlock(file, rangeStart));
+        for (uint32_t logicalBlock = rangeStart; logicalBlock < rangeEnd; logicalBlock++)
+        {
+            const int block = GetFileBlock(file, logicalBlock);
+            uint8_t *blockData = writer.NextBlock();
+            if (block == FAT_EOF || blockData == nullptr || fillBlock(logicalBlock, block, blockData) != 0)
+            {
+                return ERROR_CODE;
+            }
+        }
+        if (writer.Flush() != 0)
         {
             return ERROR_CODE;
         }
-        // If the whole block buffer is filled there will be no defined null-terminator.
-        int charactersToAppend = strlen(blockBuffer) >= BLOCK_SIZE ? BLOCK_SIZE : strlen(blockBuffer);
-        stringData.append(blockBuffer, charactersToAppend);
-        currentBlock = GetChildBlock(currentBlock);
     }
 
-    return 0;
+    if (newSize != entry.entry.size)
+    {
+        dir_entry newDirEntry = entry.entry;
+        newDirEntry.size = newSize;
+        if (UpdateDirEntry(entry, newDirEntry) != 0)
+        {
+            return ERROR_CODE;
+        }
+    }
+    return fatBatch.Flush();
 }
 
 std::vector<std::string>
@@ -1089,88 +3092,134 @@ FS::EvaluatePathType(const std::vector<std::string> &paths)
     return PATH_TYPE::INVALID;
 }
 
-int FS::GetDirEntry(const int parentDirBlock, const std::string &filename, dir_entry &dirEntryOut)
+int FS::GetDirEntry(const uint32_t parentDirBlock, const std::string &filename, ResolvedPath &resolvedOut)
 {
-    dirEntryOut = {};
+    resolvedOut = {parentDirBlock, filename, false, {}, {}};
+    if (filename.empty())
+    {
+        return 0;
+    }
 
-    dir_entry dirEntries[DIR_BLOCK_SIZE];
-    if (m_disk.read(parentDirBlock, (uint8_t *)dirEntries) != 0)
+    const DentryCache::Dentry *dentry = m_dentryCache.Find(parentDirBlock, filename);
+    if (dentry != nullptr)
+    {
+        resolvedOut.exists = dentry->exists;
+        resolvedOut.slot = dentry->slot;
+        resolvedOut.entry = dentry->entry;
+        return 0;
+    }
+
+    const DirIndex *dirIndex = GetDirIndex(parentDirBlock);
+    if (dirIndex == nullptr)
     {
         return ERROR_CODE;
     }
 
-    for (const dir_entry &dirEntry : dirEntries)
+    DirSlot dirSlot;
+    if (!dirIndex->Find(filename, dirSlot))
     {
-        if (dirEntry.file_name == filename)
-        {
-            dirEntryOut = dirEntry;
-            break;
-        }
+        m_dentryCache.Insert(parentDirBlock, filename, {false, {}, {}});
+        return 0;
+    }
+
+    const dir_entry *dirEntries = (const dir_entry *)m_cache.Peek(dirSlot.block);
+    if (dirEntries == nullptr)
+    {
+        return ERROR_CODE;
     }
+    resolvedOut.exists = true;
+    resolvedOut.slot = dirSlot;
+    resolvedOut.entry = dirEntries[dirSlot.slot];
+    m_dentryCache.Insert(parentDirBlock, filename, {true, dirSlot, resolvedOut.entry});
+    RememberParent(parentDirBlock, resolvedOut.entry);
 
     return 0;
 }
 
-int FS::GetDirEntry(std::vector<std::string> dirPaths, dir_entry &dirEntryOut)
+void FS::RememberParent(const uint32_t dirBlock, const dir_entry &dirEntry)
 {
-    dirEntryOut = {};
-
-    std::string fileName = dirPaths.back();
-    dirPaths.pop_back();
-    int parentDirBlock = GetDirectoryBlock(dirPaths);
-    // Return early if no block was found.
-    if (parentDirBlock != ERROR_CODE)
+    if (dirEntry.type != TYPE_DIR)
     {
-        // Input will always be a valid block which means that no checks has to be done.
-        GetDirEntry(parentDirBlock, fileName, dirEntryOut);
+        return;
     }
 
-    return 0;
+    // A ".." entry points the other way, from the directory up to its parent.
+    if (strcmp(dirEntry.file_name, "..") == 0)
+    {
+        m_dirParents[dirBlock] = dirEntry.first_blk;
+    }
+    else
+    {
+        m_dirParents[dirEntry.first_blk] = dirBlock;
+    }
 }
 
-int FS::UpdateDirEntry(const int parentDirBlock, const dir_entry &oldDirEntry, const dir_entry &newDirEntry)
+
+int FS::UpdateDirEntry(const ResolvedPath &resolved, const dir_entry &newDirEntry)
 {
-    dir_entry dirEntries[DIR_BLOCK_SIZE];
-    if (m_disk.read(parentDirBlock, (uint8_t *)dirEntries) != 0)
+    if (!resolved.exists)
     {
         return ERROR_CODE;
     }
 
-    for (dir_entry &dirEntry : dirEntries)
+    const dir_entry &oldDirEntry = resolved.entry;
+    const bool isRemoved = !DirEntryExists(newDirEntry);
+    const bool isRenamed = !isRemoved && strcmp(oldDirEntry.file_name, newDirEntry.file_name) != 0;
+
+    // An entry that keeps its name stays in its slot and the name index does not change.
+    if (isRemoved || isRenamed)
     {
-        if (strcmp(dirEntry.file_name, oldDirEntry.file_name) == 0)
+        DirIndex *dirIndex = GetDirIndex(resolved.parentDirBlock);
+        if (dirIndex == nullptr)
         {
-            dirEntry = newDirEntry;
-            break;
+            return ERROR_CODE;
+        }
+
+        // An empty entry removes the old one, a new name moves the old one in the index.
+        if (isRemoved)
+        {
+            dirIndex->RemoveEntry(oldDirEntry.file_name);
+        }
+        else if (!dirIndex->RenameEntry(oldDirEntry.file_name, newDirEntry.file_name))
+        {
+            return ERROR_CODE;
         }
     }
 
-    if (m_disk.write(parentDirBlock, (uint8_t *)dirEntries) != 0)
+    if (WriteDirSlot(resolved.slot, newDirEntry) != 0)
     {
         return ERROR_CODE;
     }
 
+    if (isRemoved || isRenamed)
+    {
+        m_dentryCache.Insert(resolved.parentDirBlock, oldDirEntry.file_name, {false, {}, {}});
+    }
+    if (!isRemoved)
+    {
+        m_dentryCache.Insert(resolved.parentDirBlock, newDirEntry.file_name, {true, resolved.slot, newDirEntry});
+    }
     return 0;
 }
 
-int FS::GetDirectoryBlock(const std::vector<std::string> &dirPaths)
+int FS::ResolvePath(const std::string &path, ResolvedPath &resolvedOut)
 {
-    // Return CWD block as default if no paths were given.
-    if (dirPaths.size() == 0)
+    resolvedOut = {};
+
+    const StringVector dirPaths = ParseDirPath(path);
+    if (!FilenamesAreValid(dirPaths))
     {
-        return m_cwdBlock;
+        return ERROR_CODE;
     }
 
     FS::PATH_TYPE pathType = EvaluatePathType(dirPaths);
     int startingBlock;
     switch (pathType)
     {
+    // The root directory is not an entry of any directory.
     case PATH_TYPE::INVALID:
-        return ERROR_CODE;
-        break;
-
     case PATH_TYPE::ROOT:
-        return ROOT_BLOCK;
+        return ERROR_CODE;
         break;
 
     case PATH_TYPE::RELATIVE:
@@ -1184,12 +3233,13 @@ int FS::GetDirectoryBlock(const std::vector<std::string> &dirPaths)
 
     default:
         // There is no case where default will run as all path types are covered.
+        return ERROR_CODE;
         break;
     }
 
     int currentBlock = startingBlock;
-    // Loop through all filenames and use the block its pointing to for each loop.
-    for (int i = 0; i < dirPaths.size(); i++)
+    // Loop through all directory names and use the block each one points to. The last name is looked up below.
+    for (int i = 0; i < (int)dirPaths.size() - 1; i++)
     {
         // Special cases for first element for certain path types.
         if (i == 0)
@@ -1207,16 +3257,28 @@ int FS::GetDirectoryBlock(const std::vector<std::string> &dirPaths)
             }
         }
 
-        dir_entry foundDir;
-        // No need to check for error in get dir entry as the input will always be a valid parent block.
-        GetDirEntry(currentBlock, dirPaths[i], foundDir);
-        if (!DirEntryExists(foundDir) || foundDir.type != TYPE_DIR)
+        // Known parents are followed without looking up "..".
+        if (dirPaths[i] == "..")
+        {
+            auto parent = m_dirParents.find(currentBlock);
+            if (parent != m_dirParents.end())
+            {
+                currentBlock = parent->second;
+                continue;
+            }
+        }
+
+        ResolvedPath foundDir;
+        if (GetDirEntry(currentBlock, dirPaths[i], foundDir) != 0)
+        {
+            return ERROR_CODE;
+        }
+        if (!foundDir.exists || foundDir.entry.type != TYPE_DIR)
         {
             return ERROR_CODE;
         }
-        currentBlock = foundDir.first_blk;
+        currentBlock = foundDir.entry.first_blk;
     }
 
-    // return the block that was finally landed on.
-    return currentBlock;
+    return GetDirEntry(currentBlock, dirPaths.back(), resolvedOut);
 }
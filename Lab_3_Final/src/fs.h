@@ -1,19 +1,60 @@
 #include <iostream>
 #include <cstdint>
 #include <vector>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <string_view>
 
 #include "disk.h"
+#include "aio.h"
+#include "cache.h"
+#include "freemap.h"
+#include "extentindex.h"
+#include "dirindex.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
 #define ERROR_CODE -1
 
-#define FAT_SIZE BLOCK_SIZE / 2
-#define DIR_BLOCK_SIZE BLOCK_SIZE / (uint32_t)sizeof(dir_entry)
-
+#define FAT_ENTRIES_PER_BLOCK (BLOCK_SIZE / (uint32_t)sizeof(int32_t))
+#define DIR_BLOCK_SIZE (BLOCK_SIZE / (uint32_t)sizeof(dir_entry))
+
+// Number of blocks moved per batched disk read or write when streaming file data.
+#define IO_BATCH_BLOCKS 64
+// Number of batch buffers kept for reuse once the chain walk using them is done.
+#define MAX_FREE_IO_BUFFERS 4
+// Upper limit for the number of threads fsck checks the file system with.
+#define FSCK_MAX_THREADS 16u
+// Owner id fsck claims the blocks of the root directory's chain after ROOT_BLOCK with. Entry ids start above it.
+#define FSCK_ROOT_ID 1u
+// Added to the owner of a block once fsck repair has kept the block for the entry with that id.
+#define FSCK_KEPT_FLAG 0x80000000u
+// Readahead window of a chain walk. Starts small and doubles for every window that is used to the end.
+// Reads through a handle keep their window while they continue where the last one ended, and halve it otherwise.
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS IO_BATCH_BLOCKS
+// Reads and writes through a file handle that touch at most this many blocks go through the block cache.
+// Longer ones are read ahead or written in batches like whole files.
+#define CACHED_IO_MAX_BLOCKS 4
+// Number of files that can be open at the same time.
+#define MAX_OPEN_FILES 64
+// Number of name lookups the dentry cache keeps, including names that were not found.
+#define MAX_CACHED_DENTRIES 4096
+
+// Disk layout: root directory, superblock, then as many FAT blocks as the disk size needs. Data blocks follow.
 #define ROOT_BLOCK 0
-#define FAT_BLOCK 1
+#define SUPER_BLOCK 1
+#define FAT_START_BLOCK 2
+
+#define FS_MAGIC 0x33544146 // "FAT3"
+#define FS_VERSION 1
+// Smallest and largest number of blocks a file system can be formatted with (16 KB and 64 GB).
+// The FAT of the largest file system takes 64 MB of memory.
+#define MIN_FS_BLOCKS 4
+#define MAX_FS_BLOCKS (1u << 24)
 
 #define FAT_FREE 0
 #define FAT_EOF -1
@@ -23,15 +64,24 @@
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
-#define FILE_NAME_SIZE 56
+#define FILE_NAME_SIZE 54
 
 
 struct dir_entry {
-    char file_name[FILE_NAME_SIZE]; // name of the file / sub-directory
-    uint32_t size; // size of the file in bytes
-    uint16_t first_blk; // index in the FAT for the first block of the file
+    char file_name[FILE_NAME_SIZE]; // name of the file / sub-directory, null-terminated
     uint8_t type; // directory (1) or file (0)
     uint8_t access_rights; // read (0x04), write (0x02), execute (0x01)
+    uint32_t size; // size of the file in bytes
+    uint32_t first_blk; // index in the FAT for the first block of the file
+};
+
+// Stored in SUPER_BLOCK. Describes where the FAT is and how many blocks the file system has.
+struct super_block {
+    uint32_t magic; // FS_MAGIC
+    uint32_t version; // FS_VERSION
+    uint32_t block_count; // blocks in the file system, at most the blocks of the disk
+    uint32_t fat_start; // first block of the FAT
+    uint32_t fat_blocks; // number of blocks the FAT spans
 };
 
 class FS {
@@ -53,57 +103,365 @@ private:
 
     typedef std::vector<std::string> StringVector;
 
+    // Called with the data of one block. Returning non-zero stops the walk and is passed on as the result.
+    typedef std::function<int(const uint8_t *blockData)> BlockVisitor;
+
+    // Called with one block of a directory and the entries in it, see BlockVisitor.
+    typedef std::function<int(const uint32_t block, const dir_entry *dirEntries)> DirBlockVisitor;
+
+    // Frees a batch buffer with the alignment it was allocated with.
+    struct IOBufferDeleter
+    {
+        void operator()(uint8_t *buffer) const;
+    };
+    // Memory for IO_BATCH_BLOCKS blocks, aligned to BLOCK_SIZE.
+    typedef std::unique_ptr<uint8_t[], IOBufferDeleter> IOBuffer;
+
+    // Fills the blocks of a chain in order and writes them IO_BATCH_BLOCKS at a time with one batched write.
+    // Uses two batch buffers, so with async I/O one batch is being written while the next one is filled.
+    class ChainWriter {
+    private:
+        FS &m_fs;
+        int m_nextBlock;
+        IOBuffer m_buffers[2];
+        std::vector<block_io> m_batch;
+        AsyncIO::Group m_pendingWrites[2];
+        int m_currentBuffer = 0;
+        int m_result = 0;
+    private:
+        // Submits the current batch and switches to the other buffer once its earlier writes are done.
+        int SubmitBatch();
+    public:
+        ChainWriter(FS &fs, const int startBlock);
+        // Waits for any writes still in flight and gives the buffers back to the file system.
+        ~ChainWriter();
+        // Returns a buffer for the next block of the chain, zeroed unless zeroFill is false because the caller
+        // fills all of it. The batch is written first if it is full.
+        // Returns nullptr if the chain has no more blocks or a write failed.
+        uint8_t *NextBlock(const bool zeroFill = true);
+        // Writes the blocks collected so far and waits until all writes are done.
+        int Flush();
+    };
+
+    // Reads the blocks of a chain in order and keeps the next window of blocks in flight while the current one is used.
+    // The whole chain is known from the FAT, so the blocks to read ahead never have to be guessed.
+    class ChainReader {
+    private:
+        FS &m_fs;
+        // First block of the chain that has not been requested yet.
+        int m_nextBlock;
+        // Number of blocks requested by the next Prefetch(), between READAHEAD_MIN_BLOCKS and READAHEAD_MAX_BLOCKS.
+        unsigned m_window;
+        // Number of blocks still to request before the walk stops, also if the chain goes on.
+        uint32_t m_blocksLeft;
+        IOBuffer m_buffers[2];
+        std::vector<block_io> m_batches[2];
+        AsyncIO::Group m_pendingReads[2];
+        int m_currentBuffer = 1;
+        // Index of the next block to hand out from the current batch.
+        size_t m_position = 0;
+        int m_result = 0;
+    private:
+        // Requests the next window of the chain into the given buffer and grows the window for the one after.
+        int Prefetch(const int buffer);
+    public:
+        // Reads at most blockCount blocks, starting with a window of the given number of blocks.
+        ChainReader(FS &fs, const int startBlock, const unsigned window = READAHEAD_MIN_BLOCKS,
+                    const uint32_t blockCount = UINT32_MAX);
+        // Waits for any reads still in flight and gives the buffers back to the file system.
+        ~ChainReader();
+        // Returns the data of the next block of the chain. Valid until the next call.
+        // Returns nullptr at the end of the chain or if a read failed, GetResult() tells which.
+        const uint8_t *NextBlock();
+        int GetResult() const { return m_result; }
+        // Window the next read ahead would use, so a later walk over the same file can start with it.
+        unsigned GetWindow() const { return m_window; }
+    };
+
+    // Where a name of a path was found: the directory holding it and, if an entry with that name exists,
+    // its slot and a copy of the entry. Commands change the entry through UpdateDirEntry() by its slot.
+    struct ResolvedPath
+    {
+        uint32_t parentDirBlock; // first block of the directory
+        std::string name;
+        bool exists;
+        DirSlot slot; // only set if exists
+        dir_entry entry; // only set if exists
+    };
+
+    // A dir entry found by fsck. id is unique per directory slot and is what the entry's blocks are claimed with.
+    // dirBlock is the block of the directory's chain holding the entry.
+    struct FsckEntry
+    {
+        uint32_t id;
+        uint32_t dirBlock;
+        dir_entry entry;
+    };
+
+    // State shared by the fsck worker threads.
+    struct FsckState
+    {
+        // Directory blocks waiting to be checked, each with the block of its parent directory.
+        std::vector<std::pair<uint32_t, uint32_t>> pendingDirs;
+        unsigned busyWorkers = 0;
+        std::mutex mutex;
+        std::condition_variable workAvailable;
+
+        // Lowest id of the entries whose chains contain each block, 0 if no entry does.
+        std::vector<std::atomic<uint32_t>> owners;
+        std::vector<std::atomic<bool>> crossLinked;
+        // Blocks claimed by several files that share the end of their chains after cp, which is not a problem.
+        std::vector<std::atomic<bool>> shared;
+        // Position in the chain, plus one, at which the first file reaching a shared block found it.
+        std::vector<std::atomic<uint32_t>> sharedPositions;
+        std::vector<std::atomic<bool>> visitedDirs;
+
+        // Filled under mutex when a worker finishes a directory.
+        std::vector<FsckEntry> entries;
+        // Directories whose ".." entry is missing or does not point at the parent, with the right parent block.
+        std::vector<std::pair<uint32_t, uint32_t>> badParentRefs;
+
+        std::atomic<uint64_t> directories{0};
+        std::atomic<uint64_t> files{0};
+        std::atomic<uint64_t> usedBlocks{0};
+        std::atomic<uint64_t> crossLinkedBlocks{0};
+        std::atomic<uint64_t> badChains{0};
+        std::atomic<uint64_t> badEntries{0};
+        std::atomic<uint64_t> sizeMismatches{0};
+        std::atomic<bool> readFailed{false};
+
+        FsckState(uint32_t blockCount)
+            : owners(blockCount), crossLinked(blockCount), shared(blockCount), sharedPositions(blockCount), visitedDirs(blockCount)
+        {
+        }
+    };
+
+    // Results of recent name lookups, keyed by the first block of the directory and the name.
+    // Names that were looked up but do not exist are kept as negative entries, so a missing file costs no lookup either.
+    // AddNewDirEntry and UpdateDirEntry keep the cached entries equal to the ones on disk.
+    class DentryCache {
+    public:
+        struct Dentry
+        {
+            bool exists;
+            DirSlot slot; // only set if exists
+            dir_entry entry; // only set if exists
+        };
+
+        struct Stats
+        {
+            uint64_t hits = 0;
+            // Hits on a negative entry, also counted in hits.
+            uint64_t negativeHits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+        };
+
+    private:
+        std::unordered_map<uint32_t, std::unordered_map<std::string, Dentry>> m_dirs;
+        size_t m_size = 0;
+        Stats m_stats;
+
+    public:
+        // Returns the cached lookup, or nullptr if the name has not been looked up in that directory.
+        // The pointer is valid until the next change to the cache.
+        const Dentry *Find(const uint32_t dirBlock, const std::string &name);
+        // Stores the result of a lookup, replacing an earlier one. Drops another directory's entries if the cache is full.
+        void Insert(const uint32_t dirBlock, const std::string &name, const Dentry &dentry);
+        // Drops every cached name of a directory, e.g. once the directory is removed and its block can be reused.
+        void InvalidateDirectory(const uint32_t dirBlock);
+        void Clear();
+
+        size_t GetSize() const { return m_size; }
+        const Stats &GetStats() const { return m_stats; }
+    };
+
+    // A file opened with open(). The dir entry is read from its slot on every call, so renames, appends and
+    // chmod through the shell are seen at once. rm, mv to another directory and defrag leave open files alone.
+    struct OpenFile
+    {
+        bool isOpen = false;
+        uint8_t mode = 0; // READ and/or WRITE
+        uint32_t dirBlock = 0; // first block of the directory holding the entry
+        DirSlot slot = {};
+        uint32_t firstBlock = 0;
+        // Position used by read() and write().
+        uint32_t position = 0;
+        // Last block used through the handle, so sequential calls step to the next block instead of looking it up.
+        uint32_t cachedLogicalBlock = 0;
+        int cachedBlock = FAT_EOF;
+        // Number of blocks at the start of the file that were found not to be shared with a copy, valid as long as
+        // m_shareGeneration is still shareGeneration. Lets writes skip walking the chain for shared blocks.
+        uint32_t unsharedBlocks = 0;
+        uint64_t shareGeneration = 0;
+        // Readahead window for the next pread() and the offset it starts at if the reads are sequential.
+        unsigned readaheadWindow = READAHEAD_MIN_BLOCKS;
+        uint32_t nextReadOffset = 0;
+    };
+
+    struct ReadaheadStats
+    {
+        uint64_t windows = 0;
+        uint64_t blocks = 0;
+        // Blocks that were read ahead but never used because the walk stopped early.
+        uint64_t unused = 0;
+    };
+
 private:
-    Disk m_disk;
-    // size of a FAT entry is 2 bytes.
-    int16_t m_fat[FAT_SIZE];
+    // Block device the file system lives on. Owned by the caller.
+    Disk &m_disk;
+    // Keeps several block requests in flight for batched I/O. nullptr if async I/O is disabled.
+    std::unique_ptr<AsyncIO> m_aio;
+    // All block accesses go through the cache. Must be declared after m_disk and m_aio.
+    BlockCache m_cache;
+    // One 32-bit entry per block, padded with free entries to a whole number of FAT blocks.
+    std::vector<int32_t> m_fat;
+    // Number of blocks in the file system. Entries from here on are padding and never used.
+    uint32_t m_blockCount = 0;
+    // Root, superblock and FAT blocks. Their entries are always FAT_EOF.
+    uint32_t m_reservedBlocks = 0;
+    // FAT blocks with changes that are not yet written to disk, m_fatBlockDirty tells if a block is already listed.
+    std::vector<uint32_t> m_dirtyFATBlocks;
+    std::vector<bool> m_fatBlockDirty;
+    // Extents of recently used chains. MakeFATEntry drops a chain as soon as one of its entries changes.
+    ExtentIndex m_extentIndex;
+    // Name indexes of recently used directories, keyed by the first block of the directory.
+    std::unordered_map<uint32_t, DirIndex> m_dirIndexes;
+    // Entries of recently looked up names, so resolving a path does not read the directories on the way.
+    DentryCache m_dentryCache;
+    // Free blocks of m_fat. Kept in sync by MakeFATEntry.
+    FreeMap m_freeMap;
+    // Number of FAT entries linking to each block, kept in sync by MakeFATEntry. cp lets the copy's first block
+    // link into the chain of the original, so a block linked from more than one block is shared by several files
+    // from there to the end of the chain. Shared blocks are copied before one of the files changes them.
+    std::vector<uint32_t> m_linkCounts;
+    // Number of blocks linked from more than one block. Without any, no chain has to be checked for sharing.
+    uint32_t m_sharedBlockCount = 0;
+    // Counts every time a block becomes shared or stops being shared.
+    uint64_t m_shareGeneration = 0;
+    ReadaheadStats m_readaheadStats;
+    // Freed blocks that still hold the data of their old file. They are zeroed in batches by ZeroFreedBlocks(),
+    // or not at all if they are allocated again first, since every user of an allocated block overwrites it.
+    std::vector<bool> m_needsZero;
+    uint32_t m_needsZeroCount = 0;
+    // Roving cursor for allocations that cannot be made contiguous. Next search starts where the last one ended.
+    int m_allocCursor = 0;
     // Permissions: rw-
     const uint8_t m_defaultPermissions = READ | WRITE;
 
+    // Indexed by file descriptor. Closed handles are reused by the next open().
+    std::vector<OpenFile> m_openFiles;
+
+    // Batch buffers of finished chain readers and writers, so the next ones do not have to allocate theirs.
+    std::vector<IOBuffer> m_freeIOBuffers;
+
     // Holds the block of CWD.
-    uint16_t m_cwdBlock = ROOT_BLOCK;
+    uint32_t m_cwdBlock = ROOT_BLOCK;
+    // Names of the directories from root down to CWD, empty if CWD is root.
+    StringVector m_cwdPath;
+    // Parent of every directory seen so far, by first block. Lets ".." be followed without a lookup.
+    std::unordered_map<uint32_t, uint32_t> m_dirParents;
+
+    // Number of active FAT batches. FAT writes are deferred while this is above zero.
+    int m_fatBatchDepth = 0;
 
 private:
+    // Loads the superblock and the FAT from disk, checks that they are consistent and rebuilds the free block map.
+    // Leaves the file system without free blocks if the disk does not hold a valid FAT (i.e. it needs a format).
+    int Mount();
+
     // Correctly inserts a FAT entry given its index and the value for that block.
-    int MakeFATEntry(const uint32_t index, const int16_t blockValue);
-    
-    // Writes FAT array to designated block on disk.
+    int MakeFATEntry(const uint32_t index, const int32_t blockValue);
+
+    // Writes the FAT blocks that have been changed.
     int UpdateFAT();
 
-    // Calculates a free space to write a dir entry and writes it to disk.
+    // Remembers that a FAT block has to be written by the next UpdateFAT().
+    void MarkFATBlockDirty(const uint32_t fatBlock);
+
+    // Sizes the in-memory FAT and free map for a file system of blockCount blocks, all of them used.
+    // Returns error code if blockCount is outside MIN_FS_BLOCKS and MAX_FS_BLOCKS or too small for its FAT.
+    int SetupFAT(const uint32_t blockCount);
+
+    // Writes a dir entry to a free slot of the directory, which grows by a block if it is full.
+    // Returns error code if the name is already taken in the directory.
     int AddNewDirEntry(const int parentDirectoryBlock, const dir_entry& newDirEntry);
 
+    // Returns the name index of the directory starting at dirBlock, built from the directory's blocks on first use.
+    // Returns nullptr if the directory can not be read. The pointer is valid until another directory is indexed.
+    DirIndex *GetDirIndex(const uint32_t dirBlock);
+
+    // Adds an empty block to the end of a directory and hands its slots to the directory's index.
+    int GrowDirectory(const uint32_t dirBlock, DirIndex &dirIndex);
+
+    // Writes a dir entry into the given slot.
+    int WriteDirSlot(const DirSlot &slot, const dir_entry &dirEntry);
+
+    // Calls dirBlockVisitor for each block of the directory starting at dirBlock, in chain order.
+    // The entries are read in place, so the visitor must not use the cache.
+    int ForEachDirBlock(const uint32_t dirBlock, const DirBlockVisitor &dirBlockVisitor);
+
     // Allocates a file of certain block count. Optional input to save where first block was allocated.  
     int AllocateNewFileOnFAT(const int nBlocksToAllocate, int* const allocatedFirstBlock);
 
     // Extends a file by n blocks given any block beloning to the file.
     int ExtendFileOnFAT(const int nBlocksToAllocate, const int startBlock);
 
+    // Frees the blocks of the chain starting at startBlock up to the first one that another chain still links to,
+    // which is left to the other files. Only the FAT is written, the blocks are zeroed later by ZeroFreedBlocks().
+    int FreeChain(const int startBlock);
+
+    // Frees one block of a chain that is being taken apart. Cached copies are dropped and the block is zeroed later.
+    int FreeBlock(const uint32_t block);
+
+    // Zeroes all freed blocks that have not been zeroed or allocated again, one discard per run of blocks.
+    int ZeroFreedBlocks();
+
     // Returns the child of a certain block.
     int GetChildBlock(const int block);
 
     // Calculates how many blocks should minimum be allocated given a certain size in bytes.
-    int CalculateMinBlockCount(const int size);
+    uint32_t CalculateMinBlockCount(const uint64_t size);
 
-    // Gets a copy of a dir entry given its parent directory block and its name.
-    // Outputs an empty dir entry if none were found.
-    int GetDirEntry(const int parentDirBlock, const std::string& filename, dir_entry& dirEntryOut);
+    // Looks up a name in a directory given the directory's first block, through the dentry cache.
+    // resolvedOut.exists is false if there is no entry with that name.
+    int GetDirEntry(const uint32_t parentDirBlock, const std::string& filename, ResolvedPath& resolvedOut);
 
-    // Gets a copy of a dir entry given a path to the file/directory.
-    // Outputs an empty dir entry if none were found.
-    int GetDirEntry(std::vector<std::string> dirPaths, dir_entry& dirEntryOut);
+    // Records the parent of the directory a dir entry points at, or of dirBlock itself for a ".." entry.
+    void RememberParent(const uint32_t dirBlock, const dir_entry& dirEntry);
 
-    // Updates an existing dir entry with a new dir entry given in a certain parent directory.
-    int UpdateDirEntry(const int parentDirBlock, const dir_entry& oldDirEntry, const dir_entry& newDirEntry);
+    // Validates a path and walks it once, looking up every name on the way.
+    // Returns error code if the path is invalid, a directory on the way does not exist or the path is the root itself.
+    // A missing last name is not an error, resolvedOut.exists tells if it was found.
+    int ResolvePath(const std::string& path, ResolvedPath& resolvedOut);
 
-    // Goes through all linked blocks untill EOF is reached and returns that block.
+    // Replaces the entry of a resolved path in its slot. An empty new entry removes it.
+    int UpdateDirEntry(const ResolvedPath& resolved, const dir_entry& newDirEntry);
+
+    // Returns the last block of the chain starting at startBlock.
     int GetEOFBlockFromStartBlock(const int startBlock);
 
+    // Returns the extents of the chain starting at startBlock. Built from the FAT on first use and then kept
+    // in m_extentIndex until the chain changes. The reference is valid until the next FAT change or index lookup.
+    const ExtentList &GetChainExtents(const int startBlock);
+
+    // Returns the block at position logicalBlock of the chain starting at startBlock, or FAT_EOF if the chain is shorter.
+    int GetChainBlock(const int startBlock, const uint32_t logicalBlock);
+
+    // Returns the position of the first block of the chain starting at startBlock that is linked from more than one
+    // block, or FAT_EOF if there is none. Chains only share their ends, so every block from there on is shared too.
+    int GetFirstSharedBlock(const int startBlock);
+
+    // Gives the file starting at startBlock its own copy of every shared block up to position logicalBlock, so they
+    // can be changed without changing the other files. The copies are linked in place of the shared blocks and the
+    // rest of the chain stays shared.
+    int UnshareChain(const int startBlock, const uint32_t logicalBlock);
+
     // Returns if a block is free or not.
     bool BlockIsFree(const int block);
 
-    // Returns if all elements of a given dirpath are valid or not.
-    bool FilenamesAreValid(std::string& dirpath);
+    // Returns if all elements of a given parsed dirpath are valid or not.
+    bool FilenamesAreValid(const std::vector<std::string>& parsedFilePath);
 
     // Returns true if the access rights of a given dir entry matches the bitmask given.
     bool HasValidAccess(const dir_entry& dirEntry, const int accessBitMask);
@@ -111,28 +469,89 @@ private:
     // Returns true if the filename contains any special characters.
     bool HasSpecialCharacters(const std::string& fileName);
 
-    // Checks if a certain directory contains any dir entries (except "..") by checking if it has a name or not.
+    // Checks if a certain directory contains any dir entries (except "..").
     // Assumes that input is of type DIR.
     bool DirectoryIsEmpty(const dir_entry& dirEntry);
 
-    // Checks if a given filepath ends in an existing dir entry.
-    bool FilepathExists(const std::string& filePath);
-
     // Checks if given dir entry exists by checking if the name is null or not.
     bool DirEntryExists(const dir_entry& dirEntry);
 
     // Clears input vector and loads all blocks from FAT that are free to use.
-    int GetFreeBlocks(int nBlocksToAdd, std::vector<int>& freeBlocksVector);
+    // Returns error code without touching the vector if there is not enough free space.
+    // Prefers a single contiguous run: first one starting at hintBlock (if given), then the best fitting run on the disk.
+    // Only if no run is large enough are the blocks gathered from several runs, next-fit from m_allocCursor.
+    int GetFreeBlocks(int nBlocksToAdd, std::vector<int>& freeBlocksVector, const int hintBlock = -1);
+
+    // Writes data into a file starting from its first block. The blocks are filled straight from data without copying it first.
+    int WriteDataStringToFile(std::string_view data, const dir_entry& fileDirEntry);
+
+    // Returns a batch buffer, reusing one a finished chain reader or writer gave back if there is any.
+    IOBuffer TakeIOBuffer();
+
+    // Keeps a batch buffer for the next chain walk, or frees it if enough are kept already.
+    void ReturnIOBuffer(IOBuffer buffer);
+
+    // Calls blockVisitor for each block of the chain starting at startBlock, in chain order.
+    // Blocks are read through a ChainReader, or used in place if the disk is held in memory.
+    int ForEachChainBlock(const int startBlock, const BlockVisitor &blockVisitor);
+
+    // Writes exactly the size of a file in bytes to out, one block at a time as the blocks are read.
+    // Nothing is copied or scanned, so binary data comes out unchanged and memory use does not depend on the file size.
+    int WriteFileToStream(const dir_entry& fileDirEntry, std::ostream& out);
+
+    // Appends every file and directory below the directory at dirBlock, except the ".." entries.
+    // Directories are visited depth first and each directory block only once.
+    int CollectEntries(const uint32_t dirBlock, std::vector<ResolvedPath> &entriesOut);
+
+    // Takes directories from state.pendingDirs until all are checked. Runs on several threads at once,
+    // so it only reads the disk directly and the in-memory FAT, never the cache.
+    void FsckWorker(FsckState &state);
+
+    // Checks one directory: its ".." entry, every entry in its blocks and the chain of every entry.
+    void FsckDirectory(FsckState &state, const uint32_t dirBlock, const uint32_t parentDirBlock);
 
-    // Writes data from string into file starting from its first block.
-    int WriteDataStringToFile(std::string stringData, const dir_entry& fileDirEntry);
+    // Checks the entries of one block of a directory and collects them and the sub-directories to check next.
+    void FsckDirectoryBlock(FsckState &state, const uint32_t block, const dir_entry *dirEntries, const uint32_t parentDirBlock,
+                            std::vector<FsckEntry> &entriesOut, std::vector<uint32_t> &subDirBlocksOut, bool &parentRefIsValid);
 
-    // Reads data from a file and appends it to the given string.
-    int ReadFileToDataString(std::string& stringData, const dir_entry& fileDirEntry);
+    // Claims every block of a chain for an entry. Returns false if the chain runs into a free or reserved block,
+    // out of the file system or into itself. blockCountOut is the number of blocks walked before that.
+    // Only file chains may share blocks, and only after their first block. Files sharing a block have to reach it at
+    // the same position and have fileBlockCount blocks, the number their size needs, or the block counts as cross-linked.
+    bool FsckClaimChain(FsckState &state, const uint32_t id, const uint32_t firstBlock, const bool isFileChain,
+                        const uint32_t fileBlockCount, uint32_t &blockCountOut);
 
-    // Gets the block that representes the directory (not file) at the end of a given dir path.
-    // Returns error code if no block was found or if a file was hit in the middle of the path.
-    int GetDirectoryBlock(const std::vector<std::string>& dirPaths);
+    // Fixes what fsck found: cuts chains before blocks another entry kept and files after the blocks their size needs,
+    // corrects ".." entries and frees leaked blocks. Shared blocks are kept by every file that shares them.
+    int FsckRepair(FsckState &state);
+
+    // Returns the handle of an open file descriptor, or nullptr if fd is not open.
+    OpenFile *GetOpenFile(const int fd);
+
+    // Reads the current dir entry of an open file from its slot.
+    // Returns error code if the slot no longer holds the file.
+    int GetOpenFileEntry(const OpenFile &file, ResolvedPath &entryOut);
+
+    // Returns true if any handle has the file starting at firstBlock open.
+    bool FileIsOpen(const uint32_t firstBlock);
+
+    // Makes every handle of the file starting at firstBlock look up its blocks again, after blocks were replaced or freed.
+    void ForgetCachedBlocks(const uint32_t firstBlock);
+
+    size_t OpenFileCount();
+
+    // Returns the block at position logicalBlock of an open file, or FAT_EOF if the file is shorter.
+    // Steps from the block used last when possible and remembers the result for the next call.
+    int GetFileBlock(OpenFile &file, const uint32_t logicalBlock);
+
+    // Like UnshareChain() for an open file, but only walks the chain if the handle does not already know
+    // that the blocks up to logicalBlock are not shared.
+    int UnshareFileBlocks(OpenFile &file, const uint32_t logicalBlock);
+
+    // Writes count bytes of data at offset and sets the size of the file to newSize, allocating any blocks needed.
+    // Blocks between the old end of the file and offset are zeroed. data may be nullptr if count is 0.
+    int WriteFileRange(OpenFile &file, const ResolvedPath &entry, const uint8_t *data, const uint32_t offset,
+                       const uint32_t count, const uint32_t newSize);
 
     // Returns a vector of strings containing each filename that was separated by '/' from input string.
     // If the given path only consists "/" the vector will contain one empty string.
@@ -142,10 +561,27 @@ private:
     PATH_TYPE EvaluatePathType(const std::vector<std::string>& paths);
 
 public:
-    FS();
+    // Groups FAT changes so the FAT block is written once when the outermost batch ends instead of once per
+    // changed entry. Batches can be nested.
+    class FATBatch {
+    private:
+        FS &m_fs;
+        bool m_isFlushed = false;
+    public:
+        FATBatch(FS &fs);
+        // Ends the batch if Flush() was not called, e.g. when an operation fails half way.
+        ~FATBatch();
+        // Ends the batch. The outermost batch writes the changed FAT blocks and returns the result of the write.
+        int Flush();
+    };
+
+public:
+    // ioQueueDepth is the number of block requests kept in flight by batched I/O, 0 makes all I/O synchronous.
+    FS(Disk &disk, unsigned ioQueueDepth = DEFAULT_IO_QUEUE_DEPTH);
     ~FS();
     // formats the disk, i.e., creates an empty file system
-    int format();
+    // blockCount resizes the disk to that many blocks first, 0 keeps the current disk size.
+    int format(unsigned blockCount = 0);
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
@@ -155,7 +591,8 @@ public:
     int ls();
 
     // cp <sourcepath> <destpath> makes an exact copy of the file
-    // <sourcepath> to a new file <destpath>
+    // <sourcepath> to a new file <destpath>. Only the first block is copied, the copy shares the rest of the
+    // blocks with the original until one of them is changed.
     int cp(std::string sourcepath, std::string destpath);
     // mv <sourcepath> <destpath> renames the file <sourcepath> to the name <destpath>,
     // or moves the file <sourcepath> to the directory <destpath> (if dest is a directory)
@@ -178,6 +615,44 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // sync zeroes freed blocks and writes all modified blocks held in memory back to the disk
+    int sync();
+    // stats prints the block cache, dentry cache, readahead and async I/O counters
+    int stats();
+    // df prints how many blocks are used and free on the disk
+    int df();
+    // extents <filepath> prints how many blocks the file uses and how many contiguous runs they form
+    int extents(std::string filepath);
+    // defrag [budget] moves fragmented files into contiguous runs of free blocks, most fragmented first.
+    // At most blockBudget blocks are moved per call (0 means no limit), so it can be run a bit at a time.
+    int defrag(unsigned blockBudget = 0);
+    // fsck [repair] checks the directory tree and the FAT for cross-linked and leaked blocks, entries pointing
+    // at free blocks and wrong ".." entries. With repair set the problems found are fixed.
+    int fsck(bool repair = false);
+
+    // File handles for programs that use the file system directly instead of through the shell.
+    // Every call returns error code on failure.
+
+    // open opens an existing file and returns its file descriptor. mode is READ and/or WRITE and has to be
+    // allowed by the access rights of the file.
+    int open(std::string filepath, int mode);
+    // pread reads up to count bytes starting at offset into buf and returns the number of bytes read,
+    // 0 at the end of the file. The file position is not used or moved.
+    int pread(int fd, uint8_t *buf, uint32_t count, uint32_t offset);
+    // pwrite writes count bytes from buf starting at offset and returns count. A write past the end grows the file,
+    // a gap before offset reads as zeros. The file position is not used or moved.
+    int pwrite(int fd, const uint8_t *buf, uint32_t count, uint32_t offset);
+    // read and write work like pread and pwrite at the file position and move it past the bytes transferred.
+    int read(int fd, uint8_t *buf, uint32_t count);
+    int write(int fd, const uint8_t *buf, uint32_t count);
+    // lseek sets the file position relative to the start (SEEK_SET), the current position (SEEK_CUR) or the end
+    // of the file (SEEK_END) and returns the new position.
+    int64_t lseek(int fd, int64_t offset, int whence);
+    // truncate cuts the file to length bytes, or grows it with zeros.
+    int truncate(int fd, uint32_t length);
+    // close closes the file descriptor fd.
+    int close(int fd);
 };
 
 #endif // __FS_H__
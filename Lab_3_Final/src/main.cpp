@@ -1,11 +1,45 @@
+#include <cstring>
+#include <memory>
+#include <string>
 #include "shell.h"
 #include "fs.h"
-#include "disk.h"
+#include "filedisk.h"
+#include "mmapdisk.h"
+#include "ramdisk.h"
 
 int
 main(int argc, char **argv)
 {
-    Shell shell;
+    // "--mmap" maps the disk file into memory, "--ram" keeps the whole disk in memory.
+    // The disk file is accessed with pread/pwrite otherwise.
+    // "--qd <n>" sets how many block requests batched I/O keeps in flight, 0 turns async I/O off.
+    // n is at most 4 digits, every request in flight has its own slot.
+    bool use_mmap = false;
+    bool use_ram = false;
+    unsigned io_queue_depth = DEFAULT_IO_QUEUE_DEPTH;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--mmap") == 0 && !use_ram) {
+            use_mmap = true;
+        } else if (strcmp(argv[i], "--ram") == 0 && !use_mmap) {
+            use_ram = true;
+        } else if (strcmp(argv[i], "--qd") == 0 && i + 1 < argc && argv[i + 1][0] != '\0' &&
+                   strlen(argv[i + 1]) <= 4 && strspn(argv[i + 1], "0123456789") == strlen(argv[i + 1])) {
+            io_queue_depth = (unsigned)std::stoul(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--mmap | --ram] [--qd <queue depth>]\n";
+            return -1;
+        }
+    }
+
+    std::unique_ptr<Disk> disk;
+    if (use_mmap)
+        disk = std::make_unique<MappedDisk>();
+    else if (use_ram)
+        disk = std::make_unique<RamDisk>();
+    else
+        disk = std::make_unique<FileDisk>();
+
+    Shell shell(*disk, io_queue_depth);
     shell.run();
     return 0;
 }
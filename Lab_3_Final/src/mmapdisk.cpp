@@ -0,0 +1,120 @@
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mmapdisk.h"
+
+MappedDisk::MappedDisk(const std::string& name)
+{
+    create_disk_file(name);
+    disk_fd = open(name.c_str(), O_RDWR);
+    if (disk_fd < 0) {
+        std::cerr << "ERROR: Can't open diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    fit_to_disk_file(disk_fd);
+    // the whole disk has to be backed by the file before it can be mapped
+    struct stat file_stat;
+    if (fstat(disk_fd, &file_stat) != 0 || (file_stat.st_size < (off_t)disk_size && ftruncate(disk_fd, disk_size) != 0)) {
+        std::cerr << "ERROR: Can't resize diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    if (map_disk_file() != 0) {
+        std::cerr << "ERROR: Can't map diskfile: " << name << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+}
+
+int
+MappedDisk::map_disk_file()
+{
+    void *address = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (address == MAP_FAILED) {
+        mapping = nullptr;
+        return -1;
+    }
+    mapping = (uint8_t*)address;
+    return 0;
+}
+
+MappedDisk::~MappedDisk()
+{
+    msync(mapping, disk_size, MS_SYNC);
+    munmap(mapping, disk_size);
+    close(disk_fd);
+}
+
+// writes one block to the disk
+int
+MappedDisk::write(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "MappedDisk::write"))
+        return -1;
+    // msync is only done on request, see MappedDisk::sync()
+    memcpy(mapping + (size_t)block_no * BLOCK_SIZE, blk, BLOCK_SIZE);
+    return 0;
+}
+
+// reads one block from the disk
+int
+MappedDisk::read(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "MappedDisk::read"))
+        return -1;
+    memcpy(blk, mapping + (size_t)block_no * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+// returns a pointer to the block inside the mapped disk file
+uint8_t *
+MappedDisk::map_block(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return nullptr;
+    return mapping + (size_t)block_no * BLOCK_SIZE;
+}
+
+// zeroes a range of blocks by punching a hole in the disk file, the mapping sees the zeroes right away
+int
+MappedDisk::discard(unsigned first_block, unsigned count)
+{
+    if (count == 0)
+        return 0;
+    if (!valid_block(first_block + count - 1, "MappedDisk::discard"))
+        return -1;
+    if (punch_hole(disk_fd, first_block, count) == 0)
+        return 0;
+    memset(mapping + (size_t)first_block * BLOCK_SIZE, 0, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+// grows or shrinks the disk file and maps it again, pointers from map_block() are invalid afterwards
+int
+MappedDisk::resize(unsigned new_no_blocks)
+{
+    msync(mapping, disk_size, MS_SYNC);
+    munmap(mapping, disk_size);
+    const unsigned old_no_blocks = no_blocks;
+    if (ftruncate(disk_fd, (off_t)new_no_blocks * BLOCK_SIZE) == 0) {
+        set_no_blocks(new_no_blocks);
+        if (map_disk_file() == 0)
+            return 0;
+    }
+    // keep the old disk usable if the new size can not be mapped
+    set_no_blocks(old_no_blocks);
+    ftruncate(disk_fd, disk_size);
+    if (map_disk_file() != 0) {
+        std::cerr << "ERROR: Can't map diskfile, exiting..." << std::endl;
+        exit(-1);
+    }
+    return -1;
+}
+
+// makes all previous writes durable on the disk file
+int
+MappedDisk::sync()
+{
+    return msync(mapping, disk_size, MS_SYNC) == 0 ? 0 : -1;
+}
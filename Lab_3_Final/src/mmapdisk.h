@@ -0,0 +1,25 @@
+#include "disk.h"
+
+#ifndef __MMAPDISK_H__
+#define __MMAPDISK_H__
+
+// The disk file is mapped into memory so blocks can be accessed in place.
+// Writes only become durable on the disk file when sync() is called.
+class MappedDisk : public Disk {
+private:
+    int disk_fd = -1;
+    uint8_t *mapping = nullptr;
+    // maps disk_size bytes of the disk file, returns -1 if that fails
+    int map_disk_file();
+public:
+    MappedDisk(const std::string& name = DISKNAME);
+    ~MappedDisk();
+    int write(unsigned block_no, uint8_t *blk) override;
+    int read(unsigned block_no, uint8_t *blk) override;
+    uint8_t *map_block(unsigned block_no) override;
+    int discard(unsigned first_block, unsigned count) override;
+    int resize(unsigned new_no_blocks) override;
+    int sync() override;
+};
+
+#endif // __MMAPDISK_H__
@@ -0,0 +1,57 @@
+#include <cstring>
+#include "ramdisk.h"
+
+RamDisk::RamDisk(unsigned no_blocks) : Disk(no_blocks), memory(disk_size, 0)
+{
+}
+
+// grows or shrinks the memory holding the disk
+int
+RamDisk::resize(unsigned new_no_blocks)
+{
+    memory.resize((size_t)new_no_blocks * BLOCK_SIZE, 0);
+    memory.shrink_to_fit();
+    set_no_blocks(new_no_blocks);
+    return 0;
+}
+
+// writes one block to the disk
+int
+RamDisk::write(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "RamDisk::write"))
+        return -1;
+    memcpy(memory.data() + (size_t)block_no * BLOCK_SIZE, blk, BLOCK_SIZE);
+    return 0;
+}
+
+// reads one block from the disk
+int
+RamDisk::read(unsigned block_no, uint8_t *blk)
+{
+    if (!valid_block(block_no, "RamDisk::read"))
+        return -1;
+    memcpy(blk, memory.data() + (size_t)block_no * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+// returns a pointer to the block in memory
+uint8_t *
+RamDisk::map_block(unsigned block_no)
+{
+    if (block_no >= no_blocks)
+        return nullptr;
+    return memory.data() + (size_t)block_no * BLOCK_SIZE;
+}
+
+// sets a range of blocks to zero
+int
+RamDisk::discard(unsigned first_block, unsigned count)
+{
+    if (count == 0)
+        return 0;
+    if (!valid_block(first_block + count - 1, "RamDisk::discard"))
+        return -1;
+    memset(memory.data() + (size_t)first_block * BLOCK_SIZE, 0, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
@@ -0,0 +1,21 @@
+#include <vector>
+#include "disk.h"
+
+#ifndef __RAMDISK_H__
+#define __RAMDISK_H__
+
+// The disk only exists in memory and is lost when the program exits.
+// Useful for tests, benchmarks and scratch volumes.
+class RamDisk : public Disk {
+private:
+    std::vector<uint8_t> memory;
+public:
+    RamDisk(unsigned no_blocks = DEFAULT_NO_BLOCKS);
+    int write(unsigned block_no, uint8_t *blk) override;
+    int read(unsigned block_no, uint8_t *blk) override;
+    uint8_t *map_block(unsigned block_no) override;
+    int discard(unsigned first_block, unsigned count) override;
+    int resize(unsigned new_no_blocks) override;
+};
+
+#endif // __RAMDISK_H__
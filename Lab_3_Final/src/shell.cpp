@@ -10,10 +10,11 @@ std::string commands_str[] = {
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
     "chmod",
+    "sync", "stats", "df", "extents", "defrag", "fsck",
     "help", "quit"
 };
 
-Shell::Shell()
+Shell::Shell(Disk &disk, unsigned ioQueueDepth) : filesystem(disk, ioQueueDepth)
 {
     std::cout << "Starting shell...\n";
 }
@@ -66,12 +67,16 @@ Shell::run()
         }
 
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            if (cmd_line.size() > 2 ||
+                (cmd_line.size() == 2 && (cmd_line[1].empty() || cmd_line[1].size() > 9 ||
+                                         cmd_line[1].find_first_not_of("0123456789") != std::string::npos))) {
+                std::cout << "Usage: format [<number of blocks>]\n";
                 continue;
             }
+            // without a block count the disk keeps its current size
+            unsigned block_count = cmd_line.size() == 2 ? (unsigned)std::stoul(cmd_line[1]) : 0;
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            ret_val = filesystem.format(block_count);
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
@@ -232,12 +237,90 @@ Shell::run()
             }
         }
 
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "stats") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: stats\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.stats();
+            if (ret_val) {
+                std::cout << "Error: stats failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "df") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: df\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.df();
+            if (ret_val) {
+                std::cout << "Error: df failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "extents") {
+            if (cmd_line.size() != 2) {
+                std::cout << "Usage: extents <filepath>\n";
+                continue;
+            }
+            arg1 = cmd_line[1];
+            // check return value so everything is ok
+            ret_val = filesystem.extents(arg1);
+            if (ret_val) {
+                std::cout << "Error: extents " << arg1;
+                std::cout << " failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "defrag") {
+            if (cmd_line.size() > 2 ||
+                (cmd_line.size() == 2 && (cmd_line[1].empty() || cmd_line[1].size() > 9 ||
+                                         cmd_line[1].find_first_not_of("0123456789") != std::string::npos))) {
+                std::cout << "Usage: defrag [<block budget>]\n";
+                continue;
+            }
+            // without a budget every fragmented file that fits somewhere is moved
+            unsigned block_budget = cmd_line.size() == 2 ? (unsigned)std::stoul(cmd_line[1]) : 0;
+            // check return value so everything is ok
+            ret_val = filesystem.defrag(block_budget);
+            if (ret_val) {
+                std::cout << "Error: defrag failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "fsck") {
+            if (cmd_line.size() > 2 || (cmd_line.size() == 2 && cmd_line[1] != "repair")) {
+                std::cout << "Usage: fsck [repair]\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.fsck(cmd_line.size() == 2);
+            if (ret_val) {
+                std::cout << "Error: fsck failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, stats, df, extents, defrag, fsck, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -246,7 +329,7 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, stats, df, extents, defrag, fsck, help, quit\n";
         }
     }
 }
@@ -8,7 +8,7 @@ class Shell {
 private:
     FS filesystem;
 public:
-    Shell();
+    Shell(Disk &disk, unsigned ioQueueDepth = DEFAULT_IO_QUEUE_DEPTH);
     ~Shell();
     void run();
 };
@@ -0,0 +1,127 @@
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "fs.h"
+#include "ramdisk.h"
+
+// Checks that fsck tells files sharing blocks after cp apart from files linked into each other in the FAT,
+// and that a repair leaves the file that was linked into intact.
+// Build and run with "make test".
+
+static int failures = 0;
+
+static void Check(const bool condition, const std::string &what)
+{
+    std::cout << (condition ? "PASS: " : "FAIL: ") << what << "\n";
+    failures += condition ? 0 : 1;
+}
+
+// Runs a file system operation and returns what it printed.
+template <typename Operation>
+static std::string Capture(Operation operation)
+{
+    std::ostringstream output;
+    std::streambuf *const oldBuffer = std::cout.rdbuf(output.rdbuf());
+    operation();
+    std::cout.rdbuf(oldBuffer);
+    return output.str();
+}
+
+// Formats the disk and creates "a" with one block and "testfile" with four, plus a copy of "testfile" if copy is set.
+static void CreateFiles(RamDisk &disk, const bool copy)
+{
+    std::istringstream input("x\n");
+    std::streambuf *const oldBuffer = std::cin.rdbuf(input.rdbuf());
+    Capture([&]()
+    {
+        FS fs(disk, 0);
+        fs.format();
+        fs.create("a");
+        fs.create("testfile");
+        if (copy)
+        {
+            fs.cp("testfile", "copy");
+        }
+    });
+    std::cin.rdbuf(oldBuffer);
+}
+
+// Returns the root directory entry with the given name, the disk has to be in sync with the file system.
+static dir_entry FindRootEntry(RamDisk &disk, const std::string &name)
+{
+    dir_entry dirEntries[DIR_BLOCK_SIZE];
+    disk.read(ROOT_BLOCK, (uint8_t *)dirEntries);
+    for (const dir_entry &dirEntry : dirEntries)
+    {
+        if (name == dirEntry.file_name)
+        {
+            return dirEntry;
+        }
+    }
+    return dir_entry{};
+}
+
+// Links block to target in the FAT on disk, behind the back of the file system.
+static void LinkBlock(RamDisk &disk, const uint32_t block, const int32_t target)
+{
+    int32_t fatEntries[FAT_ENTRIES_PER_BLOCK];
+    const uint32_t fatBlock = FAT_START_BLOCK + block / FAT_ENTRIES_PER_BLOCK;
+    disk.read(fatBlock, (uint8_t *)fatEntries);
+    fatEntries[block % FAT_ENTRIES_PER_BLOCK] = target;
+    disk.write(fatBlock, (uint8_t *)fatEntries);
+}
+
+static int32_t ReadFATEntry(RamDisk &disk, const uint32_t block)
+{
+    int32_t fatEntries[FAT_ENTRIES_PER_BLOCK];
+    disk.read(FAT_START_BLOCK + block / FAT_ENTRIES_PER_BLOCK, (uint8_t *)fatEntries);
+    return fatEntries[block % FAT_ENTRIES_PER_BLOCK];
+}
+
+static void TestCopiesShareBlocks()
+{
+    RamDisk disk;
+    CreateFiles(disk, true);
+
+    FS fs(disk, 0);
+    const std::string check = Capture([&]() { fs.fsck(false); });
+    Check(check.find("no problems found") != std::string::npos, "a copy sharing the blocks of testfile is not a problem");
+}
+
+static void TestLinkedFileIsCrossLinked()
+{
+    RamDisk disk;
+    CreateFiles(disk, false);
+
+    // "a" only needs its first block. Link it to the second block of "testfile" so both end in the same three blocks.
+    const dir_entry a = FindRootEntry(disk, "a");
+    const dir_entry testfile = FindRootEntry(disk, "testfile");
+    LinkBlock(disk, a.first_blk, ReadFATEntry(disk, testfile.first_blk));
+
+    FS fs(disk, 0);
+    std::string check = Capture([&]() { fs.fsck(false); });
+    Check(check.find("cross-linked blocks: 3\n") != std::string::npos, "the three blocks a was linked into are cross-linked");
+    Check(check.find("files with more or fewer blocks than their size: 1\n") != std::string::npos,
+          "a has more blocks than its size");
+
+    Capture([&]() { fs.fsck(true); });
+    check = Capture([&]() { fs.fsck(false); });
+    Check(check.find("no problems found") != std::string::npos, "one repair fixes the file system");
+
+    const std::string testfileData = Capture([&]() { fs.cat("testfile"); });
+    // cat ends the data with a line break of its own.
+    Check(testfileData == "FS::cat(testfile)\n" + std::string(BLOCK_SIZE * 3 + 1, 'a') + "\n\n",
+          "testfile keeps all of its data");
+    const std::string aData = Capture([&]() { fs.cat("a"); });
+    Check(aData == "FS::cat(a)\nx\n\n", "a keeps its own block");
+}
+
+int main()
+{
+    TestCopiesShareBlocks();
+    TestLinkedFileIsCrossLinked();
+
+    std::cout << (failures == 0 ? "All tests passed" : std::to_string(failures) + " tests failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}